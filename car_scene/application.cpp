@@ -1,37 +1,432 @@
 #include "application.hpp"
-
+#include "../common/arguments.hpp"
+#include "../common/file_cache.hpp"
+#include "../common/texture_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <glm/gtc/type_ptr.hpp>
+#include <limits>
 #include <memory>
+#include <random>
+#include <sstream>
 #include <string>
+#include <unordered_map>
+
+// GL 4.6 / ARB_texture_filter_anisotropic, same values as the EXT constants
+#ifndef GL_TEXTURE_MAX_ANISOTROPY
+#define GL_TEXTURE_MAX_ANISOTROPY 0x84FE
+#endif
+#ifndef GL_MAX_TEXTURE_MAX_ANISOTROPY
+#define GL_MAX_TEXTURE_MAX_ANISOTROPY 0x84FF
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
 using std::make_shared;
 
-GLuint load_texture_2d(const std::filesystem::path filename) {
-    int width, height, channels;
-    unsigned char* data = stbi_load(filename.generic_string().data(), &width, &height, &channels, 4);
-
-    GLuint texture;
-    glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+ThreadPool::ThreadPool(size_t threads) {
+    for (size_t i = 0; i < std::max(threads, size_t(1)); i++) {
+        workers.emplace_back([this] {
+            while (true) {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+                    if (tasks.empty()) {
+                        return;
+                    }
+                    task = std::move(tasks.front());
+                    tasks.pop();
+                }
+                task();
+            }
+        });
+    }
+}
 
-    glTextureStorage2D(texture, GLsizei(std::log2(width)), GL_RGBA8, width, height);
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
 
-    glTextureSubImage2D(texture,
-                        0,                         //
-                        0, 0,                      //
-                        width, height,             //
-                        GL_RGBA, GL_UNSIGNED_BYTE, //
-                        data);
+ImageData decode_image(const std::filesystem::path filename, int channels, bool flip) {
+    ImageData image;
+    int file_channels;
+    unsigned char* data = stbi_load(filename.generic_string().data(), &image.width, &image.height, &file_channels, channels);
+    if (data == nullptr) {
+        std::cout << "Failed to load image " << filename.generic_string() << "\n";
+        return image;
+    }
 
+    // Flipped here rather than by stbi_set_flip_vertically_on_load, which is shared by all threads
+    image.channels = channels;
+    size_t row_size = size_t(image.width) * channels;
+    image.pixels.resize(row_size * image.height);
+    for (int y = 0; y < image.height; y++) {
+        int source_row = (flip) ? image.height - 1 - y : y;
+        std::memcpy(&image.pixels[y * row_size], data + source_row * row_size, row_size);
+    }
     stbi_image_free(data);
+    return image;
+}
+
+// Hash of the v/vt/vn index triplet of a face corner.
+struct CornerHash {
+    size_t operator()(const glm::ivec3& corner) const {
+        uint64_t hash = uint32_t(corner.x);
+        hash = hash * 0x9E3779B97F4A7C15ull ^ uint32_t(corner.y);
+        hash = hash * 0x9E3779B97F4A7C15ull ^ uint32_t(corner.z);
+        return size_t(hash ^ (hash >> 32));
+    }
+};
+
+// Parses the .obj into a mesh with one vertex per distinct v/vt/vn triplet, returns an empty mesh when a face
+// refers to an element that does not exist.
+MeshData parse_obj(const std::filesystem::path filename) {
+    std::ifstream file(filename, std::ios::binary);
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (text.empty()) {
+        std::cout << "Failed to load mesh " << filename.generic_string() << "\n";
+    }
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> tex_coords;
+    std::unordered_map<glm::ivec3, uint32_t, CornerHash> corner_vertices; // v/vt/vn triplet -> vertex of the mesh
+    MeshData mesh;
+    bool valid = true;
+
+    // OBJ indices are 1-based, negative ones count from the end, 0 means the element is missing.
+    // Returns -1 for a missing element and -2 for an index outside of the elements read so far.
+    auto to_index = [](long index, size_t count) -> long {
+        if (index == 0) {
+            return -1;
+        }
+        long resolved = (index < 0) ? long(count) + index : index - 1;
+        return (resolved >= 0 && resolved < long(count)) ? resolved : -2;
+    };
+    auto add_corner = [&](long v, long vt, long vn) -> uint32_t {
+        v = to_index(v, positions.size());
+        vt = to_index(vt, tex_coords.size());
+        vn = to_index(vn, normals.size());
+        if (v < 0 || vt == -2 || vn == -2) {
+            valid = false;
+            return 0;
+        }
+        glm::ivec3 key(int(v), int(vt), int(vn));
+
+        auto found = corner_vertices.find(key);
+        if (found != corner_vertices.end()) {
+            return found->second;
+        }
+        uint32_t vertex = uint32_t(mesh.positions.size() / 3);
+        glm::vec3 normal = (vn >= 0) ? normals[vn] : glm::vec3(0.f);
+        glm::vec2 tex_coord = (vt >= 0) ? tex_coords[vt] : glm::vec2(0.f);
+        mesh.positions.insert(mesh.positions.end(), {positions[v].x, positions[v].y, positions[v].z});
+        mesh.normals.insert(mesh.normals.end(), {normal.x, normal.y, normal.z});
+        mesh.tex_coords.insert(mesh.tex_coords.end(), {tex_coord.x, tex_coord.y});
+        corner_vertices.emplace(key, vertex);
+        return vertex;
+    };
+
+    const char* c = text.c_str();
+    char* end;
+    while (*c != '\0') {
+        if (c[0] == 'v' && c[1] == ' ') {
+            glm::vec3 position;
+            position.x = std::strtof(c + 2, &end);
+            position.y = std::strtof(end, &end);
+            position.z = std::strtof(end, &end);
+            positions.push_back(position);
+        } else if (c[0] == 'v' && c[1] == 't' && c[2] == ' ') {
+            glm::vec2 tex_coord;
+            tex_coord.x = std::strtof(c + 3, &end);
+            tex_coord.y = std::strtof(end, &end);
+            tex_coords.push_back(tex_coord);
+        } else if (c[0] == 'v' && c[1] == 'n' && c[2] == ' ') {
+            glm::vec3 normal;
+            normal.x = std::strtof(c + 3, &end);
+            normal.y = std::strtof(end, &end);
+            normal.z = std::strtof(end, &end);
+            normals.push_back(normal);
+        } else if (c[0] == 'f' && c[1] == ' ') {
+            // Polygons are split into a triangle fan
+            std::vector<uint32_t> face;
+            c += 2;
+            while (true) {
+                while (*c == ' ' || *c == '\t') {
+                    c++;
+                }
+                if (*c == '\0' || *c == '\r' || *c == '\n') {
+                    break;
+                }
+                long v = std::strtol(c, &end, 10);
+                long vt = 0;
+                long vn = 0;
+                c = end;
+                if (*c == '/') {
+                    vt = std::strtol(c + 1, &end, 10); // reads nothing for v//vn
+                    c = end;
+                    if (*c == '/') {
+                        vn = std::strtol(c + 1, &end, 10);
+                        c = end;
+                    }
+                }
+                face.push_back(add_corner(v, vt, vn));
+                if (!valid) {
+                    std::cout << "Invalid face index in mesh " << filename.generic_string() << "\n";
+                    return MeshData();
+                }
+                while (*c != '\0' && *c != ' ' && *c != '\t' && *c != '\r' && *c != '\n') {
+                    c++;
+                }
+            }
+            for (size_t i = 2; i < face.size(); i++) {
+                mesh.indices.insert(mesh.indices.end(), {face[0], face[i - 1], face[i]});
+            }
+        }
+
+        while (*c != '\0' && *c != '\n') {
+            c++;
+        }
+        if (*c == '\n') {
+            c++;
+        }
+    }
+    return mesh;
+}
+
+// ----------------------------------------------------------------------------
+// Mesh cache
+// ----------------------------------------------------------------------------
+// Loads the .obj through its mesh cache, the cache is (re)generated when missing or stale.
+MeshData load_mesh_data(const std::filesystem::path filename) {
+    MeshData mesh;
+    if (!read_mesh_cache(filename, mesh)) {
+        mesh = parse_obj(filename);
+        if (!mesh.indices.empty()) {
+            write_mesh_cache(filename, mesh);
+        }
+    }
+    return mesh;
+}
+
+// Compares parsing the .obj files with loading their caches, run by --benchmark-mesh-cache.
+void benchmark_mesh_cache(const std::vector<std::filesystem::path>& filenames) {
+    const int repetitions = 5;
+    double parse_total = 0.0;
+    double cache_total = 0.0;
+
+    std::cout << "\nMesh cache benchmark (average of " << repetitions << " loads) [ms]\n";
+    for (const std::filesystem::path& filename : filenames) {
+        double start = glfwGetTime();
+        for (int i = 0; i < repetitions; i++) {
+            parse_obj(filename);
+        }
+        double parse_time = (glfwGetTime() - start) * 1000.0 / repetitions;
+
+        start = glfwGetTime();
+        for (int i = 0; i < repetitions; i++) {
+            load_mesh_data(filename);
+        }
+        double cache_time = (glfwGetTime() - start) * 1000.0 / repetitions;
+
+        std::cout << filename.filename().string() << ": obj " << parse_time << ", cache " << cache_time << "\n";
+        parse_total += parse_time;
+        cache_total += cache_time;
+    }
+    std::cout << "Total: obj " << parse_total << ", cache " << cache_total << "\n\n";
+}
+
+// ----------------------------------------------------------------------------
+// Texture cache
+// ----------------------------------------------------------------------------
+// Worker side of a texture: reads the texture cache, or decodes the image and builds its mip chain when the cache is missing or stale.
+// The cubemap faces are not flipped, OpenGL expects them top-down.
+TextureData load_texture_data(const std::filesystem::path filename, GLenum format, bool flip = true) {
+    TextureData data;
+    if (!read_texture_cache(filename, format, data.compressed)) {
+        ImageData image = decode_image(filename, 4, flip);
+        if (!image.pixels.empty()) {
+            data.mips = build_mip_chain(std::move(image));
+        }
+    }
+    return data;
+}
+
+// GL side of a texture: uploads the cached blocks, or compresses the mip chain and writes it to the texture cache.
+texture_record upload_texture_data(const std::filesystem::path& filename, const TextureData& data, GLenum format) {
+    texture_record record;
+    record.name = filename.filename().string();
+    if (!data.compressed.levels.empty()) {
+        record.texture = upload_compressed_texture(data.compressed);
+        record.width = data.compressed.width;
+        record.height = data.compressed.height;
+        record.compressed = true;
+        for (const std::vector<uint8_t>& level : data.compressed.levels) {
+            record.bytes += level.size();
+        }
+    } else if (!data.mips.empty()) {
+        CompressedImage compressed = compress_mip_chain(data.mips, format);
+        record.width = data.mips[0].width;
+        record.height = data.mips[0].height;
+        if (!compressed.levels.empty()) {
+            write_texture_cache(filename, compressed);
+            record.texture = upload_compressed_texture(compressed);
+            record.compressed = true;
+            for (const std::vector<uint8_t>& level : compressed.levels) {
+                record.bytes += level.size();
+            }
+        } else {
+            record.texture = upload_mip_chain(data.mips);
+        }
+    } else {
+        return record;
+    }
+
+    record.levels = mip_level_count(record.width, record.height);
+    for (int level = 0; level < record.levels; level++) {
+        record.rgba8_bytes += size_t(std::max(record.width >> level, 1)) * size_t(std::max(record.height >> level, 1)) * 4;
+    }
+    if (!record.compressed) {
+        record.bytes = record.rgba8_bytes;
+    }
+
+    glTextureParameteri(record.texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTextureParameteri(record.texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    return record;
+}
+
+// Compiles and links the compute shader, prints the log and returns 0 when the shader does not compile.
+GLuint create_compute_program(const std::filesystem::path filename) {
+    std::ifstream file(filename);
+    if (!file) {
+        std::cout << "Compute shader " << filename.generic_string() << " could not be opened\n";
+        return 0;
+    }
+    std::stringstream source;
+    source << file.rdbuf();
+    std::string code = source.str();
+    const char* code_ptr = code.data();
+
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(shader, 1, &code_ptr, nullptr);
+    glCompileShader(shader);
+
+    // A shader that failed to compile would only report a generic error when linking, its own log says where the error is
+    GLint compiled;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        std::cout << "Compute shader " << filename.generic_string() << " failed to compile:\n" << log << "\n";
+        glDeleteShader(shader);
+        return 0;
+    }
 
-    glGenerateTextureMipmap(texture);
+    GLuint program = glCreateProgram();
+    glAttachShader(program, shader);
+    glLinkProgram(program);
+    glDeleteShader(shader);
+
+    GLint linked;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+        std::cout << "Compute program " << filename.generic_string() << " failed to link:\n" << log << "\n";
+    }
+    return program;
+}
+
+void DynamicBuffer::create(const void* data, size_t size) {
+    this->source = static_cast<const uint8_t*>(data);
+    this->size = size;
+    region_size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glCreateBuffers(1, &buffer);
+    glNamedBufferStorage(buffer, region_size * REGIONS, nullptr, flags);
+    mapped = static_cast<uint8_t*>(glMapNamedBufferRange(buffer, 0, region_size * REGIONS, flags));
+    for (int i = 0; i < REGIONS; i++) {
+        std::memcpy(mapped + i * region_size, source, size);
+    }
+}
+
+void DynamicBuffer::destroy() {
+    for (GLsync& fence : fences) {
+        if (fence != nullptr) {
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+    }
+    glUnmapNamedBuffer(buffer);
+    glDeleteBuffers(1, &buffer);
+}
+
+void DynamicBuffer::mark_dirty(size_t offset, size_t length) {
+    for (std::vector<std::pair<size_t, size_t>>& ranges : dirty) {
+        ranges.push_back({offset, offset + length});
+    }
+}
+
+size_t DynamicBuffer::flush() {
+    current = (current + 1) % REGIONS;
+    std::vector<std::pair<size_t, size_t>>& ranges = dirty[current];
+    if (ranges.empty()) {
+        return 0;
+    }
+
+    if (fences[current] != nullptr) {
+        while (glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {
+        }
+        glDeleteSync(fences[current]);
+        fences[current] = nullptr;
+    }
+
+    // Overlapping and adjacent ranges are written by a single copy
+    size_t copied = 0;
+    std::sort(ranges.begin(), ranges.end());
+    size_t begin = ranges[0].first;
+    size_t end = ranges[0].second;
+    for (size_t i = 1; i <= ranges.size(); i++) {
+        if (i < ranges.size() && ranges[i].first <= end) {
+            end = std::max(end, ranges[i].second);
+            continue;
+        }
+        std::memcpy(mapped + current * region_size + begin, source + begin, end - begin);
+        copied += end - begin;
+        if (i < ranges.size()) {
+            begin = ranges[i].first;
+            end = ranges[i].second;
+        }
+    }
+    ranges.clear();
+    return copied;
+}
+
+void DynamicBuffer::fence() {
+    if (fences[current] != nullptr) {
+        glDeleteSync(fences[current]);
+    }
+    fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
 
-    glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+void DynamicBuffer::bind(GLenum target, GLuint index) const {
+    glBindBufferRange(target, index, buffer, current * region_size, size);
+}
 
-    return texture;
+void DynamicBuffer::bind_range(GLenum target, GLuint index, size_t offset, size_t length) const {
+    glBindBufferRange(target, index, buffer, current * region_size + offset, length);
 }
 
 Application::Application(int initial_width, int initial_height, std::vector<std::string> arguments)
@@ -46,26 +441,154 @@ Application::Application(int initial_width, int initial_height, std::vector<std:
     trees_objs_path = objects_path / "trees";
     trees_text_path = images_path / "trees";
 
+    for (const std::string& argument : arguments) {
+        unsigned int seed = 0;
+        if (parse_argument(argument, "--tree-seed=", seed)) {
+            tree_seed = seed;
+        }
+        if (parse_argument(argument, "--street-lights=", num_of_street_lights)) {
+            num_of_street_lights = std::max(num_of_street_lights, 11); // blinking_light is the 11th bulb
+        }
+        parse_argument(argument, "--anisotropy=", texture_anisotropy);
+        parse_argument(argument, "--lod-bias=", texture_lod_bias);
+        parse_argument(argument, "--benchmark=", benchmark_frames);
+        if (argument.rfind("--benchmark-report=", 0) == 0) {
+            benchmark_report = argument.substr(19);
+        }
+    }
+    gpu_timer.create([this](uint64_t frame, double ms) { benchmark_recorder.set_gpu_time(frame, ms); });
+    if (benchmark_frames > 0) {
+        // The blinking light and the trees are random and the benchmark time starts at 0, fixed values make the runs comparable
+        srand(1);
+        last_sec = 0.f;
+        tree_seed = tree_seed.value_or(1);
+    }
+
     // --------------------------------------------------------------------------
     //  Load/Create Objects
     // --------------------------------------------------------------------------
-    geometries.push_back(make_shared<Sphere>());
-    // You can use from_file function to load a Geometry from .obj file
-    Geometry meh = Geometry::from_file(objects_path / "street_lamp.obj");
-    geometries.push_back(make_shared<Geometry>(meh));
-    geometries.push_back(make_shared<Cube>());
-    geometries.push_back(make_shared<Geometry>(Geometry::from_file(objects_path / "car.obj")));
+    // Meshes and images are decoded by a thread pool while the trees are generated below,
+    // the results are uploaded on this thread as they finish (see Asset upload)
+    double t_l = glfwGetTime();
+    ThreadPool pool;
+    std::vector<pending_upload> uploads;
+    std::vector<std::filesystem::path> mesh_files;
+
+    auto add_mesh = [&](size_t index, std::filesystem::path path) {
+        std::shared_future<MeshData> mesh = pool.submit([path] { return load_mesh_data(path); }).share();
+        mesh_files.push_back(path);
+        uploads.push_back({path.filename().string(),
+                           [mesh] { return mesh.wait_for(std::chrono::seconds(0)) == std::future_status::ready; },
+                           [this, index, mesh] {
+                               const MeshData& data = mesh.get();
+                               geometries[index] = make_shared<Geometry>(data.mode, data.positions, data.indices, data.normals,
+                                                                         std::vector<float>(), data.tex_coords);
+                           }});
+    };
+    auto add_texture = [&](GLuint* texture, std::filesystem::path path) {
+        // All scene textures are colors, stored as BC7
+        GLenum format = GL_COMPRESSED_RGBA_BPTC_UNORM;
+        std::shared_future<TextureData> data = pool.submit([path, format] { return load_texture_data(path, format); }).share();
+        uploads.push_back({path.filename().string(),
+                           [data] { return data.wait_for(std::chrono::seconds(0)) == std::future_status::ready; },
+                           [this, texture, path, data, format] {
+                               texture_records.push_back(upload_texture_data(path, data.get(), format));
+                               *texture = texture_records.back().texture;
+                           }});
+    };
+
+    geometries.resize(HOUSES_OBJ + NUM_OF_HOUSES);
+    geometries[SPHERE_OBJ] = make_shared<Sphere>();
+    geometries[CUBE_OBJ] = make_shared<Cube>();
+    add_mesh(LAMP_OBJ, objects_path / "street_lamp.obj");
+    add_mesh(CAR_OBJ, objects_path / "car.obj");
+
+    for (size_t i = 0; i < NUM_OF_TREE_OBJS; i++)
+    {
+        add_mesh(TREE_OBJ + i, trees_objs_path / (std::to_string(i + 1) + "_tree.obj"));
+    }
+
+    for (size_t i = 0; i < NUM_OF_HOUSES; i++)
+    {
+        add_mesh(HOUSES_OBJ + i, objects_path / ("house_" + std::to_string(i + 1) +".obj"));
+    }
+
+    add_texture(&road_texture, images_path / "road.jpg");
+    add_texture(&car_texture, images_path / "car.jpg");
+    add_texture(&tree_6_texture, images_path / "trees/6_tree.png");
+    add_texture(&ground_texture, images_path / "ground.jpg");
+    add_texture(&pathway_texture, images_path / "pathway.jpg");
 
     for (size_t i = 0; i < NUM_OF_TREE_OBJS; i++)
     {
-        geometries.push_back(make_shared<Geometry>(Geometry::from_file(trees_objs_path / (std::to_string(i + 1) + "_tree.obj"))));
+        add_texture(&tree_textures[i], trees_text_path / (std::to_string(i + 1) + "_tree.png"));
     }
 
     for (size_t i = 0; i < NUM_OF_HOUSES; i++)
     {
-        geometries.push_back(make_shared<Geometry>(Geometry::from_file(objects_path / ("house_" + std::to_string(i + 1) +".obj"))));
+        add_texture(&house_textures[i], images_path / ("house_" + std::to_string(i + 1) +".png"));
     }
 
+    std::vector<std::string> faces = {
+        "skybox_right.jpg",
+        "skybox_left.jpg",
+        "skybox_top.jpg",
+        "skybox_bottom.jpg",
+        "skybox_front.jpg",
+        "skybox_back.jpg"
+    };
+    std::vector<std::filesystem::path> face_paths;
+    for (const std::string& face : faces) {
+        face_paths.push_back(images_path / "skybox" / face);
+    }
+    // The skybox is one BC7 cubemap file in the texture cache, read at once. Without it the faces are loaded one by one
+    auto load_cubemap_data = [face_paths] {
+        CubemapData data;
+        data.cached = read_cubemap_cache(face_paths, GL_COMPRESSED_RGBA_BPTC_UNORM, data.cached_faces);
+        for (size_t i = 0; i < 6 && !data.cached; i++) {
+            data.faces[i] = load_texture_data(face_paths[i], GL_COMPRESSED_RGBA_BPTC_UNORM, false);
+        }
+        return data;
+    };
+    std::shared_future<CubemapData> cubemap_data = pool.submit(load_cubemap_data).share();
+    uploads.push_back({"skybox",
+                       [cubemap_data] { return cubemap_data.wait_for(std::chrono::seconds(0)) == std::future_status::ready; },
+                       [this, cubemap_data, face_paths] {
+                           texture_record record = load_cubemap(face_paths, cubemap_data.get());
+                           if (record.texture != 0) {
+                               skybox = record.texture;
+                               texture_records.push_back(std::move(record));
+                           }
+                       }});
+
+    // --------------------------------------------------------------------------
+    // Generate tree locations
+    // --------------------------------------------------------------------------
+    double t_c = glfwGetTime();
+    unsigned int seed = tree_seed.value_or(static_cast<unsigned int>(time(0)));
+    std::mt19937 tree_rng(seed);
+    std::uniform_real_distribution<float> unit_dist(0.f, 1.f);
+
+    std::vector<glm::vec2> tree_positions = poisson_disk_sample(glm::vec2(-29.f, 2.f), glm::vec2(29.f, 14.f), minimal_gap, seed);
+    // Samples grow outwards from the first one, shuffle them so that every prefix (see Trees slider) covers the whole area
+    std::shuffle(tree_positions.begin(), tree_positions.end(), tree_rng);
+    if (tree_positions.size() < size_t(num_of_trees - num_of_static_trees)) {
+        std::cout << "Only " << tree_positions.size() << " trees fit with minimal gap " << minimal_gap << "\n";
+        num_of_trees = int(tree_positions.size()) + num_of_static_trees;
+    }
+    max_num_of_trees = num_of_trees;
+
+    for (size_t i = 0; i < num_of_trees - num_of_static_trees; i++) {
+        generated_trees.push_back({
+            .x = tree_positions[i].x,
+            .y = tree_positions[i].y,
+            .scale = 1.f + unit_dist(tree_rng),
+            .rotation = unit_dist(tree_rng) * 360.f,
+            .object = int(tree_rng() % NUM_OF_TREE_OBJS)
+        });
+    }
+    std::cout << "\n" << "Generating trees took: " << glfwGetTime() - t_c << "\n";
+
     // Object positions
     yellow_s = 0;
     lamp_s = yellow_s + num_of_street_lights;
@@ -80,23 +603,58 @@ Application::Application(int initial_width, int initial_height, std::vector<std:
     // Light positions
     car_lights = num_of_street_lights + 1;
 
-    // Texture loading
-    stbi_set_flip_vertically_on_load(true);
-
-    road_texture = load_texture_2d(images_path / "road.jpg");
-    car_texture = load_texture_2d(images_path / "car.jpg");
-    tree_6_texture = load_texture_2d(images_path / "trees/6_tree.png");
-    ground_texture = load_texture_2d(images_path / "ground.jpg");
-    pathway_texture = load_texture_2d(images_path / "pathway.jpg");
+    // --------------------------------------------------------------------------
+    // Asset upload
+    // --------------------------------------------------------------------------
+    // GL calls have to stay on this thread, so the decoded assets are uploaded here in the order they finish
+    size_t uploaded = 0;
+    while (uploaded < uploads.size()) {
+        bool any_ready = false;
+        for (pending_upload& upload : uploads) {
+            if (!upload.done && upload.ready()) {
+                upload.upload();
+                upload.done = true;
+                any_ready = true;
+                uploaded++;
+                std::cout << "Loaded " << upload.name << " (" << uploaded << "/" << uploads.size() << ")\n";
+            }
+        }
+        if (!any_ready) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    std::cout << "Loading assets took: " << glfwGetTime() - t_l << "\n";
 
-    for (size_t i = 0; i < NUM_OF_TREE_OBJS; i++)
-    {
-        tree_textures[i] = load_texture_2d(trees_text_path / (std::to_string(i + 1) + "_tree.png"));
+    if (std::find(arguments.begin(), arguments.end(), "--benchmark-mesh-cache") != arguments.end()) {
+        benchmark_mesh_cache(mesh_files);
     }
 
-    for (size_t i = 0; i < NUM_OF_HOUSES; i++)
-    {
-        house_textures[i] = load_texture_2d(images_path / ("house_" + std::to_string(i + 1) +".png"));
+    size_t texture_bytes = 0;
+    size_t texture_rgba8_bytes = 0;
+    std::cout << "Texture memory [KiB]:\n";
+    for (const texture_record& record : texture_records) {
+        std::cout << record.name << ": " << record.width << "x" << record.height << ", " << record.levels << " levels, "
+                  << (record.compressed ? "compressed " : "RGBA8 ") << record.bytes / 1024 << "\n";
+        texture_bytes += record.bytes;
+        texture_rgba8_bytes += record.rgba8_bytes;
+    }
+    std::cout << "Total: " << texture_bytes / 1024 << " (" << texture_rgba8_bytes / 1024 << " as RGBA8)\n";
+
+    // The skybox is sampled from its mip chain, seamless filtering avoids visible edges between the faces
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY, &max_texture_anisotropy);
+    apply_texture_policy();
+
+    // Without GL_ARB_shader_draw_parameters the scene stays on the per-object path
+    GLint extension_count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extension_count);
+    for (GLint i = 0; i < extension_count; i++) {
+        if (std::strcmp(reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i)), "GL_ARB_shader_draw_parameters") == 0) {
+            draw_parameters_supported = true;
+        }
+    }
+    if (!draw_parameters_supported) {
+        std::cout << "GL_ARB_shader_draw_parameters is not supported, indirect drawing is disabled\n";
     }
 
     glTextureParameteri(road_texture, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -104,17 +662,6 @@ Application::Application(int initial_width, int initial_height, std::vector<std:
     glTextureParameteri(ground_texture, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTextureParameteri(ground_texture, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
-    std::vector<std::string> faces = {
-        "skybox_right.jpg",
-        "skybox_left.jpg",
-        "skybox_top.jpg",
-        "skybox_bottom.jpg",
-        "skybox_front.jpg",
-        "skybox_back.jpg"
-    };
-    skybox = load_cubemap(faces); 
-
-
 #ifdef SOUND
     // Sound setup
     car_source = engine->addSoundSourceFromFile((assets_path / "car_sound.mp3").string().c_str());
@@ -131,37 +678,6 @@ Application::Application(int initial_width, int initial_height, std::vector<std:
     slider_source->setDefaultVolume(.4f);
 #endif
 
-    // --------------------------------------------------------------------------
-    // Generate tree locations
-    // --------------------------------------------------------------------------
-    double t_c = glfwGetTime();
-    int counter = 0;
-    while (counter < num_of_trees - 1) {
-        float rand_x = rand_float(-29.f, 29.f);
-        float rand_y = rand_float(2.f, 14.f);
-        bool is_ok = true;
-        for (size_t i = 0; i < counter; i++) {
-            if (glm::distance(glm::vec2(rand_x, rand_y), glm::vec2(generated_trees[i].x, generated_trees[i].y)) < minimal_gap) {
-                is_ok = false;
-                break;
-            }
-        }
-        if (is_ok) {
-            float rand_scale =  1.f + rand_float(0.f, 1.f);
-            float rand_rotation = rand_float(0.f, 360.f);
-            int rand_object = rand() % NUM_OF_TREE_OBJS;
-            generated_trees.push_back({
-                .x = rand_x,
-                .y = rand_y,
-                .scale = rand_scale,
-                .rotation = rand_rotation,
-                .object = rand_object
-            });
-            counter++;
-        }
-    }
-    std::cout << "\n" << "Generating trees took: " << glfwGetTime() - t_c << "\n";
-
     // --------------------------------------------------------------------------
     // Initialize UBO Data
     // --------------------------------------------------------------------------
@@ -304,6 +820,18 @@ Application::Application(int initial_width, int initial_height, std::vector<std:
                                 .specular_color = glm::vec4(.0f)});
     }
 
+    // Bucket the random trees by mesh, each bucket is then drawn by a single instanced call
+    std::vector<glm::mat4> tree_instances;
+    for (size_t i = 0; i < num_of_trees - num_of_static_trees; i++) {
+        tree_buckets[generated_trees[i].object].push_back(int(i));
+    }
+    for (size_t i = 0; i < NUM_OF_TREE_OBJS; i++) {
+        tree_bucket_offsets[i] = int(tree_instances.size());
+        for (int tree : tree_buckets[i]) {
+            tree_instances.push_back(objects_ubos[trees + num_of_static_trees + tree].model_matrix);
+        }
+    }
+
     // Houses
     objects_ubos.push_back({.model_matrix = glm::scale(glm::rotate(glm::translate(glm::mat4(1.0f), 
                                                                                   glm::vec3(1.7f, .24f, -3.5f)), 
@@ -398,24 +926,68 @@ Application::Application(int initial_width, int initial_height, std::vector<std:
     glCreateBuffers(1, &camera_buffer);
     glNamedBufferStorage(camera_buffer, sizeof(CameraUBO), &camera_ubo, GL_DYNAMIC_STORAGE_BIT);
 
-    glCreateBuffers(1, &lights_buffer);
-    glNamedBufferStorage(lights_buffer, sizeof(LightUBO) * lights.size(), lights.data(), GL_DYNAMIC_STORAGE_BIT);
-    
-    glCreateBuffers(1, &objects_buffer);
-    glNamedBufferStorage(objects_buffer, sizeof(ObjectUBO) * objects_ubos.size(), objects_ubos.data(), GL_DYNAMIC_STORAGE_BIT);
+    lights_buffer.create(lights.data(), sizeof(LightUBO) * lights.size());
+    objects_buffer.create(objects_ubos.data(), sizeof(ObjectUBO) * objects_ubos.size());
 
     glCreateBuffers(1, &fog_buffer);
     glNamedBufferStorage(fog_buffer, sizeof(FogUBO), &fog_ubo, GL_DYNAMIC_STORAGE_BIT);
 
+    glCreateBuffers(1, &frame_buffer);
+    glNamedBufferStorage(frame_buffer, sizeof(FrameUBO), &frame_ubo, GL_DYNAMIC_STORAGE_BIT);
+
+    glCreateBuffers(1, &tree_instances_buffer);
+    glNamedBufferStorage(tree_instances_buffer, sizeof(glm::mat4) * std::max(tree_instances.size(), size_t(1)), tree_instances.data(), 0);
+
+    glCreateBuffers(1, &cluster_counts_buffer);
+    glNamedBufferStorage(cluster_counts_buffer, sizeof(GLuint) * CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z, nullptr, 0);
+    glCreateBuffers(1, &cluster_lights_buffer);
+    glNamedBufferStorage(cluster_lights_buffer, sizeof(GLuint) * CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z * MAX_CLUSTER_LIGHTS, nullptr, 0);
+    glCreateBuffers(1, &cluster_stats_buffer);
+    glNamedBufferStorage(cluster_stats_buffer, sizeof(ClusterStatsSSBO), nullptr, 0);
+    glCreateBuffers(1, &cluster_stats_readback_buffer);
+    glNamedBufferStorage(cluster_stats_readback_buffer, sizeof(ClusterStatsSSBO), nullptr, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    cluster_stats_readback = static_cast<ClusterStatsSSBO*>(glMapNamedBufferRange(cluster_stats_readback_buffer, 0, sizeof(ClusterStatsSSBO),
+                                                                                  GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT));
+
+    build_scene_mesh();
+    build_scene_commands();
+
     compile_shaders();
 }
 
 Application::~Application() {
     delete_shaders();
     glDeleteBuffers(1, &camera_buffer);
-    glDeleteBuffers(1, &lights_buffer);
-    glDeleteBuffers(1, &objects_buffer);
+    lights_buffer.destroy();
+    objects_buffer.destroy();
     glDeleteBuffers(1, &fog_buffer);
+    glDeleteBuffers(1, &frame_buffer);
+    glDeleteBuffers(1, &tree_instances_buffer);
+    glDeleteVertexArrays(1, &scene_vao);
+    glDeleteBuffers(1, &scene_vertex_buffer);
+    glDeleteBuffers(1, &scene_index_buffer);
+    glDeleteBuffers(1, &scene_commands_buffer);
+    glDeleteBuffers(1, &scene_draws_buffer);
+    glDeleteBuffers(1, &scene_instance_commands_buffer);
+    glDeleteBuffers(1, &scene_command_bounds_buffer);
+    glDeleteBuffers(1, &scene_empty_commands_buffer);
+    glDeleteBuffers(1, &culled_commands_buffer);
+    glDeleteBuffers(1, &visible_instances_buffer);
+    glDeleteBuffers(1, &cull_stats_buffer);
+    glUnmapNamedBuffer(cull_stats_readback_buffer);
+    glDeleteBuffers(1, &cull_stats_readback_buffer);
+    if (cull_stats_fence != nullptr) {
+        glDeleteSync(cull_stats_fence);
+    }
+    glDeleteBuffers(1, &cluster_counts_buffer);
+    glDeleteBuffers(1, &cluster_lights_buffer);
+    glDeleteBuffers(1, &cluster_stats_buffer);
+    glUnmapNamedBuffer(cluster_stats_readback_buffer);
+    glDeleteBuffers(1, &cluster_stats_readback_buffer);
+    if (cluster_stats_fence != nullptr) {
+        glDeleteSync(cluster_stats_fence);
+    }
+    gpu_timer.destroy();
 }
 
 // ----------------------------------------------------------------------------
@@ -429,6 +1001,11 @@ void Application::compile_shaders() {
     main_program = create_program(lecture_shaders_path / "main.vert", lecture_shaders_path / "main.frag");
     lights_program = create_program(lecture_shaders_path / "light_objects.vert", lecture_shaders_path / "light_objects.frag");
     skybox_program = create_program(lecture_shaders_path / "skybox.vert", lecture_shaders_path / "skybox.frag");
+    cull_program = create_compute_program(lecture_shaders_path / "cull.comp");
+    clusters_program = create_compute_program(lecture_shaders_path / "clusters.comp");
+
+    main_uniforms.resolve(main_program, {"has_texture", "texture_scale", "instanced", "instance_offset", "indirect", "culling"});
+    cull_uniforms.resolve(cull_program, {"cull_distance"});
 }
 
 void Application::update(float delta) {}
@@ -437,12 +1014,18 @@ void Application::render() {
     // --------------------------------------------------------------------------
     // Update others
     // --------------------------------------------------------------------------
-    // Time
-    float currentFrame = float(glfwGetTime());
+    double render_start = glfwGetTime();
+    if (benchmark_frames > 0) {
+        gpu_timer.begin(benchmark_recorder.frame_count());
+    }
+
+    // Time, the benchmark advances by a fixed step
+    float currentFrame = (benchmark_frames > 0) ? last_frame + BENCHMARK_TIME_STEP_MS / 1000.f : float(glfwGetTime());
     delta_time = currentFrame - last_frame;
     last_frame = currentFrame;
     float camera_speed = delta_time * ((plr.sprint) ? 10.f : 1.f);
     float car_speed = delta_time * 2.f * car_pause;
+    bool car_moved = car_speed != 0.f;
     car_pos.x += (car_pos.x < 25.f) ? car_speed : -50.f;
 
     // Blinking light
@@ -450,15 +1033,17 @@ void Application::render() {
         last_sec += .5f;
         light_on = rand() % 2 == 0;
         objects_ubos[blinking_light].ambient_color = (light_on) ? glm::vec4(1.0f, 1.0f, 0.1f, 1.0f) : glm::vec4(0.05f);
+        objects_buffer.mark_dirty(blinking_light * sizeof(ObjectUBO), sizeof(ObjectUBO));
     }
-    glNamedBufferSubData(objects_buffer, blinking_light * 256, sizeof(ObjectUBO), &objects_ubos[blinking_light]);
 
     // General light
     glm::vec4 tmp_light = (night_vision) ? glm::vec4(1.f) : glm::vec4(.1f);
-    lights[0].ambient_color = tmp_light;
-    lights[0].diffuse_color = tmp_light;
-    lights[0].specular_color = tmp_light;
-    glNamedBufferSubData(lights_buffer, 0, sizeof(LightUBO), &lights[0]);
+    if (lights[0].ambient_color != tmp_light) {
+        lights[0].ambient_color = tmp_light;
+        lights[0].diffuse_color = tmp_light;
+        lights[0].specular_color = tmp_light;
+        lights_buffer.mark_dirty(0, sizeof(LightUBO));
+    }
 
     // --------------------------------------------------------------------------
     // Update sound
@@ -493,7 +1078,14 @@ void Application::render() {
     // Update UBOs
     // --------------------------------------------------------------------------
     // Camera
-    if (p_view) {
+    if (benchmark_frames > 0) {
+        // One circle around the street, rising and sinking twice
+        float angle = glm::radians(360.f * float(benchmark_recorder.frame_count()) / benchmark_frames);
+        glm::vec3 eye = glm::vec3(30.f * cosf(angle), 6.f + 4.f * sinf(2.f * angle), 30.f * sinf(angle));
+        camera_ubo.position = eye;
+        camera_ubo.projection = glm::perspective(glm::radians(45.0f), static_cast<float>(width) / static_cast<float>(height), 0.01f, 1000.0f);
+        camera_ubo.view = glm::lookAt(eye, glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    } else if (p_view) {
         glm::vec3 *camera_front = &(plr.cam.camera_front);
         glm::vec3 *camera_pos = &(plr.cam.camera_pos);
         glm::vec3 camera_dir = glm::vec3(camera_front->x , camera_front->y, camera_front->z);
@@ -520,20 +1112,30 @@ void Application::render() {
         camera_ubo.view = glm::lookAt(camera.get_eye_position(), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
     }
     glNamedBufferSubData(camera_buffer, 0, sizeof(CameraUBO), &camera_ubo);
+    frame_upload_bytes += sizeof(CameraUBO);
 
     // Car
     objects_ubos[car].model_matrix = glm::scale(glm::rotate(glm::translate(glm::mat4(1.0f), 
                                                                            car_pos), 
                                                             glm::radians(90.f), glm::vec3(0.f, 1.f, 0.f)), 
                                                 glm::vec3(0.6f));
-    glNamedBufferSubData(objects_buffer, car * 256, sizeof(ObjectUBO), &objects_ubos[car]);
+    if (car_moved) {
+        objects_buffer.mark_dirty(car * sizeof(ObjectUBO), sizeof(ObjectUBO));
+    }
+    if (indirect_drawing) {
+        scene_draws[scene_car_draw].model_matrix = objects_ubos[car].model_matrix;
+        glNamedBufferSubData(scene_draws_buffer, scene_car_draw * sizeof(DrawDataSSBO), sizeof(glm::mat4), &scene_draws[scene_car_draw]);
+        frame_upload_bytes += sizeof(glm::mat4);
+    }
 
     // Car lights
     LightUBO *car_l_p = &lights[car_lights]; // car light pointer for iterating through lights
     for (int i = 0; i < 4; i++) {
         (car_l_p + i)->position.x = car_pos.x + ((i < 2) ? .3f : -.3f);
     }
-    glNamedBufferSubData(lights_buffer, car_lights * sizeof(LightUBO), 4 * sizeof(LightUBO), car_l_p);
+    if (car_moved) {
+        lights_buffer.mark_dirty(car_lights * sizeof(LightUBO), 4 * sizeof(LightUBO));
+    }
 
     // Car light objects
     ObjectUBO *car_light_obj = &objects_ubos[car_lights_s]; // car light object pointer for iterating through light objects
@@ -548,7 +1150,28 @@ void Application::render() {
                                                                       car_pos + car_lights_pos[i]),  
                                                        glm::vec3(0.009f, 0.01f, 0.015f));
     }
-    glNamedBufferSubData(objects_buffer, car_lights_s * sizeof(ObjectUBO), 4 * sizeof(ObjectUBO), car_light_obj);
+    if (car_moved) {
+        objects_buffer.mark_dirty(car_lights_s * sizeof(ObjectUBO), 4 * sizeof(ObjectUBO));
+    }
+
+    // Writes the changes into regions of the ring the GPU is not reading
+    frame_upload_bytes += objects_buffer.flush();
+    frame_upload_bytes += lights_buffer.flush();
+
+    // Frame settings
+    FrameUBO frame = {.screen_size = glm::vec2(width, height),
+                      .toon_shading_on = toon_shading,
+                      .toon_levels = toon_levels,
+                      .fog_on = fog,
+                      .night_vision = night_vision,
+                      .light_on = light_on,
+                      .blinking_light = blinking_light,
+                      .clustered = clustered_lighting};
+    if (frame != frame_ubo) {
+        frame_ubo = frame;
+        glNamedBufferSubData(frame_buffer, 0, sizeof(FrameUBO), &frame_ubo);
+        frame_upload_bytes += sizeof(FrameUBO);
+    }
 
     // --------------------------------------------------------------------------
     // Draw scene
@@ -578,104 +1201,168 @@ void Application::render() {
     // --------------------------------------------------------------------------
     // Draw objects
     // --------------------------------------------------------------------------
-    glUseProgram(main_program);
-
     glBindBufferBase(GL_UNIFORM_BUFFER, 0, camera_buffer);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, lights_buffer);
+    lights_buffer.bind(GL_SHADER_STORAGE_BUFFER, 1);
     glBindBufferBase(GL_UNIFORM_BUFFER, 3, fog_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, cluster_counts_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, cluster_lights_buffer);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 6, frame_buffer);
+
+    // Assign lights to clusters, one invocation per cluster
+    if (clustered_lighting) {
+        glClearNamedBufferData(cluster_stats_buffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, cluster_stats_buffer);
+        glUseProgram(clusters_program);
+        glDispatchCompute(1, 1, CLUSTERS_Z);
+        frame_draw_calls++;
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+        // The overflow counts are read back without stalling, the same way as the culling counts
+        if (cluster_stats_fence != nullptr && glClientWaitSync(cluster_stats_fence, 0, 0) != GL_TIMEOUT_EXPIRED) {
+            cluster_stats = *cluster_stats_readback;
+            glDeleteSync(cluster_stats_fence);
+            cluster_stats_fence = nullptr;
+        }
+        if (cluster_stats_fence == nullptr) {
+            glCopyNamedBufferSubData(cluster_stats_buffer, cluster_stats_readback_buffer, 0, 0, sizeof(ClusterStatsSSBO));
+            cluster_stats_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+    }
+
+    glUseProgram(main_program);
+    glUniform1i(main_uniforms[MainUniform::has_texture], false);
 
-    glUniform1i(glGetUniformLocation(main_program, "has_texture"), false);
-    glUniform1i(glGetUniformLocation(main_program, "toon_shading_on"), toon_shading);
-    glUniform1i(glGetUniformLocation(main_program, "toon_levels"), toon_levels);
-    glUniform1i(glGetUniformLocation(main_program, "light_on"), light_on);
-    glUniform1i(glGetUniformLocation(main_program, "blinking_light"), blinking_light);
-    glUniform1i(glGetUniformLocation(main_program, "fog_on"), fog);
-    glUniform1i(glGetUniformLocation(lights_program, "fog_on"), fog);
-    glProgramUniform1i(skybox_program, 15, night_vision);
-    glProgramUniform1i(skybox_program, 3, fog);
+    double submission_start = glfwGetTime();
 
     // Bulbs
     glUseProgram(lights_program);
     for (size_t i = yellow_s; i < yellow_s + num_of_street_lights; i++)
     {
-        glBindBufferRange(GL_UNIFORM_BUFFER, 2, objects_buffer, i * 256, sizeof(ObjectUBO));
+        objects_buffer.bind_range(GL_UNIFORM_BUFFER, 2, i * sizeof(ObjectUBO), sizeof(ObjectUBO));
         geometries[SPHERE_OBJ]->draw();
+        frame_draw_calls++;
     }
 
-    // Street lights
     glUseProgram(main_program);
-    for (size_t i = lamp_s; i < lamp_s + num_of_street_lights; i++)
-    {
-        glBindBufferRange(GL_UNIFORM_BUFFER, 2, objects_buffer, i * 256, sizeof(ObjectUBO));
-        geometries[LAMP_OBJ]->draw();
-    }
-    
-    // Road
-    glBindBufferRange(GL_UNIFORM_BUFFER, 2, objects_buffer, road * 256, sizeof(ObjectUBO));
+    if (indirect_drawing) {
+        // Random trees - the commands follow the Trees slider
+        if (scene_uploaded_trees != num_of_trees) {
+            for (size_t i = 0; i < NUM_OF_TREE_OBJS; i++) {
+                scene_commands[scene_tree_commands + i].instance_count = GLuint(visible_trees(int(i)));
+            }
+            glNamedBufferSubData(scene_commands_buffer, scene_tree_commands * sizeof(DrawElementsIndirectCommand),
+                                 NUM_OF_TREE_OBJS * sizeof(DrawElementsIndirectCommand), &scene_commands[scene_tree_commands]);
+            frame_upload_bytes += NUM_OF_TREE_OBJS * sizeof(DrawElementsIndirectCommand);
+            scene_uploaded_trees = num_of_trees;
+        }
 
-    glUniform1i(glGetUniformLocation(main_program, "has_texture"), true);
-    glUniform2f(glGetUniformLocation(main_program, "texture_scale"), 30.f, 1.f);
-    
-    glBindTextureUnit(4, road_texture);
-    geometries[CUBE_OBJ]->draw();
+        if (gpu_culling) {
+            cull_scene();
+            glUseProgram(main_program);
+        }
 
-    // Ground objects
-    glUniform2f(glGetUniformLocation(main_program, "texture_scale"), 30.f, 15.f);
-    glBindTextureUnit(4, ground_texture);
-    for (size_t i = 0; i < 2; i++)
-    {
-        glBindBufferRange(GL_UNIFORM_BUFFER, 2, objects_buffer, (ground + i) * 256, sizeof(ObjectUBO));
-        geometries[CUBE_OBJ]->draw();
-    }
+        // Street lights, road, ground, car, trees, houses and pathways in one call
+        glUniform1i(main_uniforms[MainUniform::indirect], true);
+        glUniform1i(main_uniforms[MainUniform::culling], gpu_culling);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, scene_draws_buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, visible_instances_buffer);
+        glBindTextures(4, GLsizei(scene_textures.size()), scene_textures.data());
+        glBindVertexArray(scene_vao);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, (gpu_culling) ? culled_commands_buffer : scene_commands_buffer);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, GLsizei(scene_commands.size()), 0);
+        frame_draw_calls++;
+        glUniform1i(main_uniforms[MainUniform::indirect], false);
+    } else {
+        // Street lights
+        for (size_t i = lamp_s; i < lamp_s + num_of_street_lights; i++)
+        {
+            objects_buffer.bind_range(GL_UNIFORM_BUFFER, 2, i * sizeof(ObjectUBO), sizeof(ObjectUBO));
+            geometries[LAMP_OBJ]->draw();
+            frame_draw_calls++;
+        }
 
-    // Car
-    glBindBufferRange(GL_UNIFORM_BUFFER, 2, objects_buffer, car * 256, sizeof(ObjectUBO));
-    glUniform2f(glGetUniformLocation(main_program, "texture_scale"), 1.f, 1.f);
-    glTextureParameteri(road_texture, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTextureParameteri(road_texture, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    
-    glBindTextureUnit(4, car_texture);
-    geometries[CAR_OBJ]->draw();
+        // Road
+        objects_buffer.bind_range(GL_UNIFORM_BUFFER, 2, road * sizeof(ObjectUBO), sizeof(ObjectUBO));
 
-    // Car lights
-    glUseProgram(lights_program);
-    for (size_t i = car_lights_s; i < car_lights_s + 4; i++)
-    {
-        glBindBufferRange(GL_UNIFORM_BUFFER, 2, objects_buffer, i * 256, sizeof(ObjectUBO));
+        glUniform1i(main_uniforms[MainUniform::has_texture], true);
+        glUniform2f(main_uniforms[MainUniform::texture_scale], 30.f, 1.f);
+
+        glBindTextureUnit(4, road_texture);
         geometries[CUBE_OBJ]->draw();
-    }
+        frame_draw_calls++;
 
-    // Tree in front of house
-    glUseProgram(main_program);
-    glBindTextureUnit(4, tree_textures[3]);
-    glBindBufferRange(GL_UNIFORM_BUFFER, 2, objects_buffer, trees * 256, sizeof(ObjectUBO));
-    geometries[TREE_OBJ + 3]->draw();
+        // Ground objects
+        glUniform2f(main_uniforms[MainUniform::texture_scale], 30.f, 15.f);
+        glBindTextureUnit(4, ground_texture);
+        for (size_t i = 0; i < 2; i++)
+        {
+            objects_buffer.bind_range(GL_UNIFORM_BUFFER, 2, (ground + i) * sizeof(ObjectUBO), sizeof(ObjectUBO));
+            geometries[CUBE_OBJ]->draw();
+            frame_draw_calls++;
+        }
 
-    // Random trees
-    for (size_t i = 0; i < num_of_trees - num_of_static_trees; i++)
-    {
-        glBindTextureUnit(4, tree_textures[generated_trees[i].object]);
-        glBindBufferRange(GL_UNIFORM_BUFFER, 2, objects_buffer, (trees + num_of_static_trees + i) * 256, sizeof(ObjectUBO));
-        geometries[TREE_OBJ + generated_trees[i].object]->draw();
-    }
-    
-    // Houses
-    for (size_t i = 0; i < NUM_OF_HOUSES; i++)
-    {
-        glBindBufferRange(GL_UNIFORM_BUFFER, 2, objects_buffer, (houses + i) * 256, sizeof(ObjectUBO));
-        glBindTextureUnit(4, house_textures[i]);
-        geometries[HOUSES_OBJ + i]->draw();
+        // Car
+        objects_buffer.bind_range(GL_UNIFORM_BUFFER, 2, car * sizeof(ObjectUBO), sizeof(ObjectUBO));
+        glUniform2f(main_uniforms[MainUniform::texture_scale], 1.f, 1.f);
+        glTextureParameteri(road_texture, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTextureParameteri(road_texture, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+        glBindTextureUnit(4, car_texture);
+        geometries[CAR_OBJ]->draw();
+        frame_draw_calls++;
+
+        // Tree in front of house
+        glBindTextureUnit(4, tree_textures[3]);
+        objects_buffer.bind_range(GL_UNIFORM_BUFFER, 2, trees * sizeof(ObjectUBO), sizeof(ObjectUBO));
+        geometries[TREE_OBJ + 3]->draw();
+        frame_draw_calls++;
+
+        // Random trees - one instanced draw per tree mesh, the material is shared with the tree above
+        glUniform1i(main_uniforms[MainUniform::instanced], true);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, tree_instances_buffer);
+        for (size_t i = 0; i < NUM_OF_TREE_OBJS; i++)
+        {
+            GLsizei count = visible_trees(int(i));
+            if (count == 0) {
+                continue;
+            }
+            glUniform1i(main_uniforms[MainUniform::instance_offset], tree_bucket_offsets[i]);
+            glBindTextureUnit(4, tree_textures[i]);
+            draw_instanced(*geometries[TREE_OBJ + i], count);
+        }
+        glUniform1i(main_uniforms[MainUniform::instanced], false);
+
+        // Houses
+        for (size_t i = 0; i < NUM_OF_HOUSES; i++)
+        {
+            objects_buffer.bind_range(GL_UNIFORM_BUFFER, 2, (houses + i) * sizeof(ObjectUBO), sizeof(ObjectUBO));
+            glBindTextureUnit(4, house_textures[i]);
+            geometries[HOUSES_OBJ + i]->draw();
+            frame_draw_calls++;
+        }
+
+        // Pathways
+        for (size_t i = 0; i < num_of_pathways; i++)
+        {
+            glUniform2f(main_uniforms[MainUniform::texture_scale], pathway_scales[i].x * 10, pathway_scales[i].y * 10);
+            objects_buffer.bind_range(GL_UNIFORM_BUFFER, 2, (pathways + i) * sizeof(ObjectUBO), sizeof(ObjectUBO));
+            glBindTextureUnit(4, pathway_texture);
+            geometries[CUBE_OBJ]->draw();
+            frame_draw_calls++;
+        }
     }
 
-    // Pathways
-    for (size_t i = 0; i < num_of_pathways; i++)
+    // Car lights
+    glUseProgram(lights_program);
+    for (size_t i = car_lights_s; i < car_lights_s + 4; i++)
     {
-        glUniform2f(glGetUniformLocation(main_program, "texture_scale"), pathway_scales[i].x * 10, pathway_scales[i].y * 10);
-        glBindBufferRange(GL_UNIFORM_BUFFER, 2, objects_buffer, (pathways + i) * 256, sizeof(ObjectUBO));
-        glBindTextureUnit(4, pathway_texture);
+        objects_buffer.bind_range(GL_UNIFORM_BUFFER, 2, i * sizeof(ObjectUBO), sizeof(ObjectUBO));
         geometries[CUBE_OBJ]->draw();
+        frame_draw_calls++;
     }
 
+    submission_time = .95 * submission_time + .05 * (glfwGetTime() - submission_start) * 1000.0;
+
     // Skybox
     glUseProgram(skybox_program);
     glDepthFunc(GL_LEQUAL);
@@ -684,8 +1371,30 @@ void Application::render() {
 
     glBindTextureUnit(4, skybox);
     geometries[CUBE_OBJ]->draw();
+    frame_draw_calls++;
 
     glDepthFunc(GL_LESS);
+
+    objects_buffer.fence();
+    lights_buffer.fence();
+
+    if (benchmark_frames > 0) {
+        gpu_timer.end();
+        gpu_timer.collect();
+        finish_benchmark_frame((glfwGetTime() - render_start) * 1000.0);
+    }
+    frame_draw_calls = 0;
+    frame_upload_bytes = 0;
+}
+
+void Application::finish_benchmark_frame(double cpu_ms) {
+    benchmark_recorder.add_frame(cpu_ms, frame_draw_calls, frame_upload_bytes);
+
+    if (int(benchmark_recorder.frame_count()) == benchmark_frames) {
+        gpu_timer.flush();
+        benchmark_recorder.write_report(benchmark_report, "car_scene");
+        glfwSetWindowShouldClose(window, GLFW_TRUE);
+    }
 }
 
 void Application::render_ui() { 
@@ -735,7 +1444,7 @@ void Application::render_ui() {
         ImGui::End();
     } else if (controls) {
         ImGui::Begin("Controls", nullptr, ImGuiWindowFlags_NoDecoration);
-        ImGui::SetWindowSize(ImVec2(16 * unit, 15 * unit));
+        ImGui::SetWindowSize(ImVec2(16 * unit, 18 * unit));
         ImGui::SetWindowPos(ImVec2(width / 2 - 8.f * unit, height / 3.f));
 
         ImGui::Text("          ");
@@ -752,6 +1461,9 @@ void Application::render_ui() {
         ImGui::Text("       Night vision: N");
         ImGui::Text("Toggle toon shading: T");
         ImGui::Text("         Toggle fog: F");
+        ImGui::Text("   Indirect drawing: I");
+        ImGui::Text("        GPU culling: C");
+        ImGui::Text(" Clustered lighting: L");
         ImGui::Text("");
 
         ImGui::Text("            ");
@@ -764,7 +1476,7 @@ void Application::render_ui() {
         ImGui::End();
     } else if (settings) {
         ImGui::Begin("Settings", nullptr, ImGuiWindowFlags_NoDecoration);
-        ImGui::SetWindowSize(ImVec2(16 * unit, 10 * unit));
+        ImGui::SetWindowSize(ImVec2(16 * unit, 23 * unit));
         ImGui::SetWindowPos(ImVec2(width / 2 - 8.f * unit, height / 3.f));
 
         ImGui::Text("          ");
@@ -774,12 +1486,49 @@ void Application::render_ui() {
         ImGui::Separator();
         ImGui::Text("");
 
-        if (ImGui::SliderInt("Trees", &num_of_trees, 1, 1500, "%d", ImGuiSliderFlags_AlwaysClamp)) {
+        if (ImGui::SliderInt("Trees", &num_of_trees, 1, max_num_of_trees, "%d", ImGuiSliderFlags_AlwaysClamp)) {
             engine->play2D(slider_source);
         }
         if (ImGui::SliderInt("Toon levels", &toon_levels, 4, 20, "%d", ImGuiSliderFlags_AlwaysClamp)) {
             engine->play2D(slider_source);
         }
+        if (ImGui::Checkbox("Indirect drawing", &indirect_drawing)) {
+            engine->play2D(click_source);
+            indirect_drawing = indirect_drawing && draw_parameters_supported;
+            gpu_culling = gpu_culling && indirect_drawing;
+        }
+        if (ImGui::Checkbox("GPU culling", &gpu_culling)) {
+            engine->play2D(click_source);
+            gpu_culling = gpu_culling && draw_parameters_supported;
+            indirect_drawing = indirect_drawing || gpu_culling;
+        }
+        if (ImGui::SliderFloat("Cull distance", &cull_distance, 5.f, 100.f, "%.0f", ImGuiSliderFlags_AlwaysClamp)) {
+            engine->play2D(slider_source);
+        }
+        if (gpu_culling) {
+            ImGui::Text("Visible: %u, culled: %u", cull_stats.visible, cull_stats.culled);
+        }
+        if (ImGui::Checkbox("Clustered lighting", &clustered_lighting)) {
+            engine->play2D(click_source);
+        }
+        if (clustered_lighting && cluster_stats.overflowing_clusters > 0) {
+            ImGui::Text("Full clusters: %u, dropped lights: %u", cluster_stats.overflowing_clusters, cluster_stats.dropped_lights);
+        }
+        if (ImGui::SliderFloat("Anisotropy", &texture_anisotropy, 1.f, max_texture_anisotropy, "%.0f", ImGuiSliderFlags_AlwaysClamp)) {
+            engine->play2D(slider_source);
+            apply_texture_policy();
+        }
+        if (ImGui::SliderFloat("LOD bias", &texture_lod_bias, -2.f, 2.f, "%.1f", ImGuiSliderFlags_AlwaysClamp)) {
+            engine->play2D(slider_source);
+            apply_texture_policy();
+        }
+        size_t texture_bytes = 0;
+        for (const texture_record& record : texture_records) {
+            texture_bytes += record.bytes;
+        }
+        ImGui::Text("Texture memory: %.1f MiB", texture_bytes / (1024.0 * 1024.0));
+        // CPU time spent issuing the draws of the scene, compare with indirect drawing on and off
+        ImGui::Text("Scene submission: %.3f ms", submission_time);
 
         ImGui::Text("");
         ImGui::Text("            ");
@@ -872,6 +1621,17 @@ void Application::on_key_pressed(int key, int scancode, int action, int mods) {
     if (key == GLFW_KEY_T && action != GLFW_RELEASE) {
         toon_shading = !toon_shading;
     }
+    if (key == GLFW_KEY_I && action != GLFW_RELEASE) {
+        indirect_drawing = !indirect_drawing && draw_parameters_supported;
+        gpu_culling = gpu_culling && indirect_drawing;
+    }
+    if (key == GLFW_KEY_C && action != GLFW_RELEASE) {
+        gpu_culling = !gpu_culling && draw_parameters_supported;
+        indirect_drawing = indirect_drawing || gpu_culling;
+    }
+    if (key == GLFW_KEY_L && action != GLFW_RELEASE) {
+        clustered_lighting = !clustered_lighting;
+    }
     if (key == GLFW_KEY_W) {
         if (action == GLFW_PRESS || action == GLFW_REPEAT) {
             plr.wasd.w = true;
@@ -910,26 +1670,392 @@ float Application::rand_float(float low, float high) {
     return low + static_cast<float>(rand()) / ( static_cast<float>(RAND_MAX/(high - low)));
 }
 
-GLuint Application::load_cubemap(std::vector<std::string> faces)
-{
-    GLuint texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+std::vector<glm::vec2> Application::poisson_disk_sample(glm::vec2 min, glm::vec2 max, float gap, unsigned int seed) {
+    const int attempts = 30;                       // candidates tried around one sample before it is retired
+    const float cell_size = gap / glm::sqrt(2.f); // a cell this small can hold at most one sample
+    const int grid_w = int(glm::ceil((max.x - min.x) / cell_size));
+    const int grid_h = int(glm::ceil((max.y - min.y) / cell_size));
 
-    int width, height, nrChannels;
-    stbi_set_flip_vertically_on_load(false);
-    for (size_t i = 0; i < faces.size(); i++)
-    {
-        unsigned char *data = stbi_load((images_path / "skybox" / faces[i]).generic_string().data(), &width, &height, &nrChannels, 0);
-            
-        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-        stbi_image_free(data);
-    }
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
-    return texture;
-} 
+    std::vector<int> grid(grid_w * grid_h, -1); // index of the sample in each cell
+    std::vector<glm::vec2> samples;
+    std::vector<int> active;
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> unit_dist(0.f, 1.f);
+
+    auto cell_of = [&](glm::vec2 p) {
+        return glm::min(glm::ivec2((p - min) / cell_size), glm::ivec2(grid_w - 1, grid_h - 1));
+    };
+    auto insert = [&](glm::vec2 p) {
+        glm::ivec2 cell = cell_of(p);
+        grid[cell.y * grid_w + cell.x] = int(samples.size());
+        active.push_back(int(samples.size()));
+        samples.push_back(p);
+    };
+
+    insert(min + glm::vec2(unit_dist(rng), unit_dist(rng)) * (max - min));
+    while (!active.empty()) {
+        size_t slot = std::uniform_int_distribution<size_t>(0, active.size() - 1)(rng);
+        glm::vec2 origin = samples[active[slot]];
+
+        bool found = false;
+        for (int k = 0; k < attempts && !found; k++) {
+            // Candidates are taken from the annulus [gap, 2 * gap) around the origin
+            float angle = unit_dist(rng) * glm::two_pi<float>();
+            float radius = gap * (1.f + unit_dist(rng));
+            glm::vec2 candidate = origin + radius * glm::vec2(glm::cos(angle), glm::sin(angle));
+            if (candidate.x < min.x || candidate.y < min.y || candidate.x >= max.x || candidate.y >= max.y) {
+                continue;
+            }
+
+            // Samples closer than gap can only be in the surrounding 5x5 cells
+            glm::ivec2 cell = cell_of(candidate);
+            found = true;
+            for (int y = std::max(cell.y - 2, 0); y <= std::min(cell.y + 2, grid_h - 1) && found; y++) {
+                for (int x = std::max(cell.x - 2, 0); x <= std::min(cell.x + 2, grid_w - 1); x++) {
+                    int other = grid[y * grid_w + x];
+                    if (other >= 0 && glm::distance(candidate, samples[other]) < gap) {
+                        found = false;
+                        break;
+                    }
+                }
+            }
+            if (found) {
+                insert(candidate);
+            }
+        }
+
+        if (!found) {
+            active[slot] = active.back();
+            active.pop_back();
+        }
+    }
+
+    return samples;
+}
+
+void Application::draw_instanced(const Geometry& geometry, GLsizei count) {
+    geometry.bind_vao();
+    if (geometry.draw_elements_count > 0) {
+        glDrawElementsInstanced(geometry.mode, geometry.draw_elements_count, GL_UNSIGNED_INT, nullptr, count);
+    } else {
+        glDrawArraysInstanced(geometry.mode, 0, geometry.draw_arrays_count, count);
+    }
+    frame_draw_calls++;
+}
+
+GLsizei Application::visible_trees(int bucket) const {
+    // Buckets are sorted, so the trees enabled by the slider are a prefix of each bucket
+    return GLsizei(std::lower_bound(tree_buckets[bucket].begin(), tree_buckets[bucket].end(), num_of_trees - num_of_static_trees) -
+                   tree_buckets[bucket].begin());
+}
+
+void Application::build_scene_mesh() {
+    std::vector<scene_vertex> vertices;
+    std::vector<GLuint> indices;
+
+    for (const std::shared_ptr<Geometry>& geometry : geometries) {
+        // All geometries drawn by main_program are triangle lists, the indirect call draws them as such
+        scene_mesh mesh = {.first_index = GLuint(indices.size()), .count = 0, .base_vertex = GLint(vertices.size())};
+
+        size_t vertex_count = geometry->positions.size() / 3;
+        glm::vec3 bounds_min = glm::vec3(std::numeric_limits<float>::max());
+        glm::vec3 bounds_max = glm::vec3(-std::numeric_limits<float>::max());
+        for (size_t v = 0; v < vertex_count; v++) {
+            scene_vertex vertex = {glm::make_vec3(&geometry->positions[3 * v]), glm::vec3(0.f), glm::vec2(0.f)};
+            if (geometry->normals.size() >= 3 * (v + 1)) {
+                vertex.normal = glm::make_vec3(&geometry->normals[3 * v]);
+            }
+            if (geometry->tex_coords.size() >= 2 * (v + 1)) {
+                vertex.tex_coord = glm::make_vec2(&geometry->tex_coords[2 * v]);
+            }
+            vertices.push_back(vertex);
+            bounds_min = glm::min(bounds_min, vertex.position);
+            bounds_max = glm::max(bounds_max, vertex.position);
+        }
+
+        // Sphere around the bounding box, good enough for culling
+        glm::vec3 center = (vertex_count > 0) ? (bounds_min + bounds_max) * .5f : glm::vec3(0.f);
+        float radius = 0.f;
+        for (size_t v = size_t(mesh.base_vertex); v < vertices.size(); v++) {
+            radius = std::max(radius, glm::distance(center, vertices[v].position));
+        }
+        mesh.bounds = glm::vec4(center, radius);
+
+        if (geometry->indices.empty()) {
+            for (size_t v = 0; v < vertex_count; v++) {
+                indices.push_back(GLuint(v));
+            }
+        } else {
+            indices.insert(indices.end(), geometry->indices.begin(), geometry->indices.end());
+        }
+
+        mesh.count = GLuint(indices.size()) - mesh.first_index;
+        scene_meshes.push_back(mesh);
+    }
+
+    glCreateBuffers(1, &scene_vertex_buffer);
+    glNamedBufferStorage(scene_vertex_buffer, sizeof(scene_vertex) * vertices.size(), vertices.data(), 0);
+    glCreateBuffers(1, &scene_index_buffer);
+    glNamedBufferStorage(scene_index_buffer, sizeof(GLuint) * indices.size(), indices.data(), 0);
+
+    // The same attribute locations as the geometries, so that main.vert works with both
+    glCreateVertexArrays(1, &scene_vao);
+    glVertexArrayVertexBuffer(scene_vao, 0, scene_vertex_buffer, 0, sizeof(scene_vertex));
+    glVertexArrayElementBuffer(scene_vao, scene_index_buffer);
+
+    glEnableVertexArrayAttrib(scene_vao, 0);
+    glVertexArrayAttribFormat(scene_vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof(scene_vertex, position));
+    glVertexArrayAttribBinding(scene_vao, 0, 0);
+
+    glEnableVertexArrayAttrib(scene_vao, 1);
+    glVertexArrayAttribFormat(scene_vao, 1, 3, GL_FLOAT, GL_FALSE, offsetof(scene_vertex, normal));
+    glVertexArrayAttribBinding(scene_vao, 1, 0);
+
+    glEnableVertexArrayAttrib(scene_vao, 2);
+    glVertexArrayAttribFormat(scene_vao, 2, 2, GL_FLOAT, GL_FALSE, offsetof(scene_vertex, tex_coord));
+    glVertexArrayAttribBinding(scene_vao, 2, 0);
+}
+
+void Application::build_scene_commands() {
+    // Every command draws one mesh, its instances are consecutive entries of scene_draws starting at base_instance.
+    // All instances of one command use the same texture, so the index into albedo_textures is uniform within every draw
+    // of the multi-draw, which main.frag relies on when it indexes the sampler array.
+    std::vector<glm::vec4> command_bounds;
+    std::vector<GLuint> instance_commands;
+    int command_geometry = 0;
+    std::optional<GLuint> command_texture;
+    auto add_command = [&](int geometry) {
+        const scene_mesh& mesh = scene_meshes[geometry];
+        command_geometry = geometry;
+        command_texture.reset();
+        scene_commands.push_back({.count = mesh.count,
+                                  .instance_count = 0,
+                                  .first_index = mesh.first_index,
+                                  .base_vertex = mesh.base_vertex,
+                                  .base_instance = GLuint(scene_draws.size())});
+        command_bounds.push_back(mesh.bounds);
+    };
+    auto add_instance = [&](int object, GLuint texture, glm::vec2 texture_scale) {
+        if (command_texture.has_value() && *command_texture != texture) {
+            add_command(command_geometry); // an instance with another texture starts a new command of the same mesh
+        }
+        command_texture = texture;
+        const ObjectUBO& ubo = objects_ubos[object];
+        float slot = (texture != 0) ? float(scene_texture_slot(texture)) : 0.f;
+        scene_draws.push_back({.model_matrix = ubo.model_matrix,
+                               .ambient_color = ubo.ambient_color,
+                               .diffuse_color = ubo.diffuse_color,
+                               .specular_color = ubo.specular_color,
+                               .texture_params = glm::vec4(texture_scale, (texture != 0) ? 1.f : 0.f, slot)});
+        scene_commands.back().instance_count++;
+        instance_commands.push_back(GLuint(scene_commands.size()) - 1);
+    };
+
+    // Street lights
+    add_command(LAMP_OBJ);
+    for (int i = lamp_s; i < lamp_s + num_of_street_lights; i++) {
+        add_instance(i, 0, glm::vec2(1.f));
+    }
+
+    // Road
+    add_command(CUBE_OBJ);
+    add_instance(road, road_texture, glm::vec2(30.f, 1.f));
+
+    // Ground objects
+    add_command(CUBE_OBJ);
+    for (int i = 0; i < 2; i++) {
+        add_instance(ground + i, ground_texture, glm::vec2(30.f, 15.f));
+    }
+
+    // Car - the model matrix is updated every frame
+    add_command(CAR_OBJ);
+    scene_car_draw = int(scene_draws.size());
+    add_instance(car, car_texture, glm::vec2(1.f));
+
+    // Tree in front of house
+    add_command(TREE_OBJ + 3);
+    add_instance(trees, tree_textures[3], glm::vec2(1.f));
+
+    // Random trees - instance_count is set according to the Trees slider before drawing
+    scene_tree_commands = int(scene_commands.size());
+    for (int i = 0; i < NUM_OF_TREE_OBJS; i++) {
+        add_command(TREE_OBJ + i);
+        for (int tree : tree_buckets[i]) {
+            add_instance(trees + num_of_static_trees + tree, tree_textures[i], glm::vec2(1.f));
+        }
+    }
+
+    // Houses
+    for (int i = 0; i < NUM_OF_HOUSES; i++) {
+        add_command(HOUSES_OBJ + i);
+        add_instance(houses + i, house_textures[i], glm::vec2(1.f));
+    }
+
+    // Pathways
+    add_command(CUBE_OBJ);
+    for (int i = 0; i < num_of_pathways; i++) {
+        add_instance(pathways + i, pathway_texture, pathway_scales[i] * 10.f);
+    }
+
+    glCreateBuffers(1, &scene_commands_buffer);
+    glNamedBufferStorage(scene_commands_buffer, sizeof(DrawElementsIndirectCommand) * scene_commands.size(), scene_commands.data(), GL_DYNAMIC_STORAGE_BIT);
+    glCreateBuffers(1, &scene_draws_buffer);
+    glNamedBufferStorage(scene_draws_buffer, sizeof(DrawDataSSBO) * scene_draws.size(), scene_draws.data(), GL_DYNAMIC_STORAGE_BIT);
+
+    // Buffers of the culling pass
+    std::vector<DrawElementsIndirectCommand> empty_commands = scene_commands;
+    for (DrawElementsIndirectCommand& command : empty_commands) {
+        command.instance_count = 0;
+    }
+    glCreateBuffers(1, &scene_empty_commands_buffer);
+    glNamedBufferStorage(scene_empty_commands_buffer, sizeof(DrawElementsIndirectCommand) * empty_commands.size(), empty_commands.data(), 0);
+    glCreateBuffers(1, &culled_commands_buffer);
+    glNamedBufferStorage(culled_commands_buffer, sizeof(DrawElementsIndirectCommand) * scene_commands.size(), nullptr, 0);
+
+    glCreateBuffers(1, &scene_instance_commands_buffer);
+    glNamedBufferStorage(scene_instance_commands_buffer, sizeof(GLuint) * instance_commands.size(), instance_commands.data(), 0);
+    glCreateBuffers(1, &scene_command_bounds_buffer);
+    glNamedBufferStorage(scene_command_bounds_buffer, sizeof(glm::vec4) * command_bounds.size(), command_bounds.data(), 0);
+    glCreateBuffers(1, &visible_instances_buffer);
+    glNamedBufferStorage(visible_instances_buffer, sizeof(GLuint) * scene_draws.size(), nullptr, 0);
+
+    glCreateBuffers(1, &cull_stats_buffer);
+    glNamedBufferStorage(cull_stats_buffer, sizeof(CullStatsSSBO), nullptr, 0);
+    glCreateBuffers(1, &cull_stats_readback_buffer);
+    glNamedBufferStorage(cull_stats_readback_buffer, sizeof(CullStatsSSBO), nullptr, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    cull_stats_readback = static_cast<CullStatsSSBO*>(glMapNamedBufferRange(cull_stats_readback_buffer, 0, sizeof(CullStatsSSBO),
+                                                                            GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT));
+}
+
+void Application::cull_scene() {
+    // Culled commands start empty, the compute shader adds the visible instances
+    glCopyNamedBufferSubData(scene_empty_commands_buffer, culled_commands_buffer, 0, 0, sizeof(DrawElementsIndirectCommand) * scene_commands.size());
+    glClearNamedBufferData(cull_stats_buffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+    glUseProgram(cull_program);
+    glUniform1f(cull_uniforms[CullUniform::cull_distance], cull_distance);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, scene_draws_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, visible_instances_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, scene_commands_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, scene_instance_commands_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, scene_command_bounds_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, culled_commands_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, cull_stats_buffer);
+    glDispatchCompute((GLuint(scene_draws.size()) + 63) / 64, 1, 1);
+    frame_draw_calls++;
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    // The counts are read back without stalling, a new copy starts only when the previous one has arrived
+    if (cull_stats_fence != nullptr && glClientWaitSync(cull_stats_fence, 0, 0) != GL_TIMEOUT_EXPIRED) {
+        cull_stats = *cull_stats_readback;
+        glDeleteSync(cull_stats_fence);
+        cull_stats_fence = nullptr;
+    }
+    if (cull_stats_fence == nullptr) {
+        glCopyNamedBufferSubData(cull_stats_buffer, cull_stats_readback_buffer, 0, 0, sizeof(CullStatsSSBO));
+        cull_stats_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+}
+
+int Application::scene_texture_slot(GLuint texture) {
+    auto it = std::find(scene_textures.begin(), scene_textures.end(), texture);
+    if (it != scene_textures.end()) {
+        return int(it - scene_textures.begin());
+    }
+    // The textures are bound from unit 4, so the driver limit may allow fewer textures than the array in main.frag has
+    GLint max_units = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &max_units);
+    if (scene_textures.size() >= std::min<size_t>(NUM_OF_SCENE_TEXTURES, size_t(std::max(max_units - 4, 1)))) {
+        std::cout << "Too many scene textures, increase NUM_OF_SCENE_TEXTURES or draw without textures\n";
+        return 0;
+    }
+    scene_textures.push_back(texture);
+    return int(scene_textures.size()) - 1;
+}
+
+void Application::apply_texture_policy() {
+    float anisotropy = std::clamp(texture_anisotropy, 1.0f, max_texture_anisotropy);
+    for (const texture_record& record : texture_records) {
+        glTextureParameterf(record.texture, GL_TEXTURE_MAX_ANISOTROPY, anisotropy);
+        glTextureParameterf(record.texture, GL_TEXTURE_LOD_BIAS, texture_lod_bias);
+    }
+}
+
+texture_record Application::load_cubemap(const std::vector<std::filesystem::path>& face_paths, const CubemapData& data) {
+    const GLenum format = GL_COMPRESSED_RGBA_BPTC_UNORM;
+    texture_record record;
+    record.name = "skybox";
+
+    // Without the cubemap cache the faces come from their 2D caches or are compressed here, then the cubemap cache is written
+    std::array<CompressedImage, 6> compressed;
+    bool all_compressed = true;
+    if (!data.cached) {
+        for (size_t i = 0; i < 6 && all_compressed; i++) {
+            if (!data.faces[i].compressed.levels.empty()) {
+                compressed[i] = data.faces[i].compressed;
+            } else if (!data.faces[i].mips.empty()) {
+                compressed[i] = compress_mip_chain(data.faces[i].mips, format);
+                all_compressed = !compressed[i].levels.empty();
+            } else {
+                std::cout << "Failed to load skybox face " << face_paths[i].generic_string() << "\n";
+                return record;
+            }
+        }
+    }
+
+    const std::array<CompressedImage, 6>& face_blocks = (data.cached) ? data.cached_faces : compressed;
+
+    // RGBA8 fallback for drivers that do not compress, a face that came from a cache is decoded again
+    std::array<std::vector<ImageData>, 6> mips;
+    if (!all_compressed) {
+        for (size_t i = 0; i < 6; i++) {
+            mips[i] = (!data.faces[i].mips.empty()) ? data.faces[i].mips : build_mip_chain(decode_image(face_paths[i], 4, false));
+        }
+    }
+
+    for (size_t i = 0; i < 6; i++) {
+        int width = (all_compressed) ? face_blocks[i].width : mips[i][0].width;
+        int height = (all_compressed) ? face_blocks[i].height : mips[i][0].height;
+        if (width == 0 || width != height || (i > 0 && width != record.width)) {
+            std::cout << "Skybox faces have to be square images of the same size\n";
+            return record;
+        }
+        record.width = width;
+        record.height = height;
+    }
+    record.levels = mip_level_count(record.width, record.height);
+    record.compressed = all_compressed;
+    if (all_compressed && !data.cached) {
+        write_cubemap_cache(face_paths, face_blocks);
+    }
+
+    glCreateTextures(GL_TEXTURE_CUBE_MAP, 1, &record.texture);
+    glTextureStorage2D(record.texture, record.levels, (all_compressed) ? format : GL_RGBA8, record.width, record.height);
+
+    // The faces of a cubemap are addressed as layers (zoffset) of the immutable storage
+    for (GLint level = 0; level < record.levels; level++) {
+        int size = std::max(record.width >> level, 1);
+        for (GLint face = 0; face < 6; face++) {
+            if (all_compressed) {
+                const std::vector<uint8_t>& blocks = face_blocks[face].levels[level];
+                glCompressedTextureSubImage3D(record.texture, level, 0, 0, face, size, size, 1, format, GLsizei(blocks.size()), blocks.data());
+                record.bytes += blocks.size();
+            } else {
+                const ImageData& image = mips[face][level];
+                glTextureSubImage3D(record.texture, level, 0, 0, face, size, size, 1, GL_RGBA, GL_UNSIGNED_BYTE, image.pixels.data());
+            }
+            record.rgba8_bytes += size_t(size) * size_t(size) * 4;
+        }
+    }
+    if (!record.compressed) {
+        record.bytes = record.rgba8_bytes;
+    }
+
+    glTextureParameteri(record.texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTextureParameteri(record.texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(record.texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(record.texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(record.texture, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    return record;
+}
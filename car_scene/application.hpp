@@ -7,12 +7,23 @@
 
 #pragma once
 
+#include "../common/benchmark.hpp"
+#include "../common/mesh_cache.hpp"
+#include "../common/texture_cache.hpp"
 #include "camera.h"
 #include "cube.hpp"
 #include "pv112_application.hpp"
 #include "sphere.hpp"
 #include "teapot.hpp"
+#include <array>
+#include <condition_variable>
+#include <functional>
+#include <future>
 #include <irrKlang.h>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <thread>
 
 // ----------------------------------------------------------------------------
 // DEFINES
@@ -30,6 +41,13 @@
 #define NUM_OF_TREE_OBJS 6
 #define HOUSES_OBJ ((TREE_OBJ + NUM_OF_TREE_OBJS))
 #define NUM_OF_HOUSES 4
+#define NUM_OF_SCENE_TEXTURES 20 // must match the size of albedo_textures in main.frag, the scene uses 14 now
+
+// Light clusters, must match main.frag and clusters.comp
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 9
+#define CLUSTERS_Z 24
+#define MAX_CLUSTER_LIGHTS 64
 
 #define SOUND
 
@@ -68,6 +86,141 @@ struct tree_stats {
     int object;
 };
 
+// Vertex of the merged scene mesh used by indirect drawing
+struct scene_vertex {
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 tex_coord;
+};
+
+// Place of one geometry in the merged scene mesh
+struct scene_mesh {
+    GLuint first_index;
+    GLuint count;
+    GLint base_vertex;
+    glm::vec4 bounds; // bounding sphere in object space, center in .xyz and radius in .w
+};
+
+// Layout of one command of glMultiDrawElementsIndirect, given by OpenGL
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instance_count;
+    GLuint first_index;
+    GLint base_vertex;
+    GLuint base_instance;
+};
+
+// Texture prepared by a worker thread, either read from the texture cache or decoded with its
+// uncompressed mip chain, which the GL thread compresses and writes to the cache
+struct TextureData {
+    CompressedImage compressed;
+    std::vector<ImageData> mips;
+};
+
+// Skybox prepared by a worker thread, either the six faces read from the cubemap cache at once or, when it is
+// missing or stale, each face loaded like a 2D texture
+struct CubemapData {
+    bool cached = false;
+    std::array<CompressedImage, 6> cached_faces;
+    std::array<TextureData, 6> faces;
+};
+
+// Texture created by the loader, kept for the sampling policy and the texture memory accounting
+struct texture_record {
+    std::string name;
+    GLuint texture = 0;
+    int width = 0;
+    int height = 0;
+    int levels = 0;
+    bool compressed = false;
+    size_t bytes = 0;       // size of all levels in VRAM
+    size_t rgba8_bytes = 0; // size of the same chain as uncompressed RGBA8
+};
+
+// Asset decoded in the background, upload is called on the GL thread once ready returns true
+struct pending_upload {
+    std::string name;
+    std::function<bool()> ready;
+    std::function<void()> upload;
+    bool done = false;
+};
+
+// Fixed set of worker threads executing submitted tasks in FIFO order
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+
+  public:
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency());
+    /** Finishes the queued tasks and joins the workers. */
+    ~ThreadPool();
+
+    /** Queues the task, its result is delivered through the returned future. */
+    template <typename Task>
+    std::future<std::invoke_result_t<Task>> submit(Task task) {
+        auto packaged = std::make_shared<std::packaged_task<std::invoke_result_t<Task>()>>(std::move(task));
+        std::future<std::invoke_result_t<Task>> result = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push([packaged] { (*packaged)(); });
+        }
+        condition.notify_one();
+        return result;
+    }
+};
+
+// Uniform locations of one program, resolved by name once after compilation and looked up by an enum key
+template <typename Key, size_t N = size_t(Key::count)>
+class UniformLocations {
+    std::array<GLint, N> locations;
+
+  public:
+    void resolve(GLuint program, const std::array<const char*, N>& names) {
+        for (size_t i = 0; i < N; i++) {
+            locations[i] = glGetUniformLocation(program, names[i]);
+        }
+    }
+
+    GLint operator[](Key key) const { return locations[size_t(key)]; }
+};
+
+// GPU copy of a CPU array that is written through a persistently mapped ring of REGIONS copies.
+// Changes are recorded by mark_dirty, flush writes the coalesced dirty ranges into the next region while
+// the GPU may still read the previous ones, fence marks the end of the frame that used the current region.
+class DynamicBuffer {
+    static const int REGIONS = 3;
+    static const size_t ALIGNMENT = 256; // satisfies uniform and storage buffer offset alignment
+
+    GLuint buffer = 0;
+    const uint8_t* source = nullptr; // the CPU array, must not be reallocated
+    size_t size = 0;                 // bytes of one copy
+    size_t region_size = 0;          // size rounded up to ALIGNMENT
+    uint8_t* mapped = nullptr;
+    int current = 0;
+    GLsync fences[REGIONS] = {};
+    std::vector<std::pair<size_t, size_t>> dirty[REGIONS]; // [begin, end) ranges each region is missing
+
+  public:
+    void create(const void* data, size_t size);
+    void destroy();
+
+    /** Records that the bytes [offset, offset + length) of the CPU array changed. */
+    void mark_dirty(size_t offset, size_t length);
+    /** Moves to the next region and brings it up to date, waits only if the GPU still reads it. Returns the bytes copied. */
+    size_t flush();
+    /** Guards the current region until the GPU finishes the commands issued so far. */
+    void fence();
+
+    void bind(GLenum target, GLuint index) const;
+    void bind_range(GLenum target, GLuint index, size_t offset, size_t length) const;
+};
+
+enum class MainUniform { has_texture, texture_scale, instanced, instance_offset, indirect, culling, count };
+enum class CullUniform { cull_distance, count };
+
 // ----------------------------------------------------------------------------
 // UNIFORM STRUCTS
 // ----------------------------------------------------------------------------
@@ -97,6 +250,43 @@ struct alignas(256) ObjectUBO {
     glm::vec4 specular_color; // [ 96 - 112) bytes
 };
 
+// Per-instance data of indirect drawing, indexed by gl_BaseInstance + gl_InstanceID
+struct DrawDataSSBO {
+    glm::mat4 model_matrix;   // [  0 -  64) bytes
+    glm::vec4 ambient_color;  // [ 64 -  80) bytes
+    glm::vec4 diffuse_color;  // [ 80 -  96) bytes
+    glm::vec4 specular_color; // [ 96 - 112) bytes
+
+    // Contains texture scale in .xy, has_texture in .z and the index into albedo_textures in .w
+    glm::vec4 texture_params; // [112 - 128) bytes
+};
+
+// Results of the culling pass, filled by atomics in cull.comp
+struct CullStatsSSBO {
+    GLuint visible;
+    GLuint culled;
+};
+
+// Counts of clusters.comp, the lights above MAX_CLUSTER_LIGHTS are not assigned to the cluster
+struct ClusterStatsSSBO {
+    GLuint overflowing_clusters;
+    GLuint dropped_lights;
+};
+
+// Settings shared by the whole frame, the buffer is updated only when they change
+struct alignas(16) FrameUBO {
+    glm::vec2 screen_size;
+    GLint toon_shading_on;
+    GLint toon_levels;
+    GLint fog_on;
+    GLint night_vision;
+    GLint light_on;
+    GLint blinking_light;
+    GLint clustered;
+
+    bool operator==(const FrameUBO&) const = default;
+};
+
 struct FogUBO {
     glm::vec4 color;
     float density;
@@ -119,10 +309,16 @@ class Application : public PV112Application {
 
     // Main program
     GLuint main_program;
+    GLuint cull_program;
+    GLuint clusters_program;
     // TODO: feel free to add as many as you need/like
     GLuint lights_program;
     GLuint skybox_program;
 
+    // Uniform locations, resolved in compile_shaders
+    UniformLocations<MainUniform> main_uniforms;
+    UniformLocations<CullUniform> cull_uniforms;
+
     // List of geometries used in the project
     std::vector<std::shared_ptr<Geometry>> geometries;
     int num_of_street_lights = 19;
@@ -145,7 +341,63 @@ class Application : public PV112Application {
     std::vector<tree_stats> generated_trees;
     float minimal_gap = .5f;
     int num_of_trees = 1500;
+    int max_num_of_trees = 1500; // how many trees were actually generated (see Trees slider)
     int num_of_static_trees = 1;
+    std::optional<unsigned int> tree_seed; // set by --tree-seed=<n>, seeded from time when unset
+
+    // Random trees bucketed by tree_stats::object for instanced drawing
+    std::vector<int> tree_buckets[NUM_OF_TREE_OBJS]; // indices into generated_trees, ascending
+    int tree_bucket_offsets[NUM_OF_TREE_OBJS];       // first instance of each bucket in tree_instances_buffer
+    GLuint tree_instances_buffer = 0;
+
+    // Indirect drawing of everything that uses main_program by a single glMultiDrawElementsIndirect
+    bool indirect_drawing = false;
+    bool draw_parameters_supported = false; // main.vert reads gl_BaseInstanceARB in indirect draws
+    std::vector<scene_mesh> scene_meshes; // indexed the same as geometries
+    GLuint scene_vao = 0;
+    GLuint scene_vertex_buffer = 0;
+    GLuint scene_index_buffer = 0;
+    std::vector<DrawElementsIndirectCommand> scene_commands;
+    GLuint scene_commands_buffer = 0;
+    std::vector<DrawDataSSBO> scene_draws;
+    GLuint scene_draws_buffer = 0;
+    std::vector<GLuint> scene_textures;    // bound to units 4, 5, ... in this order
+    int scene_car_draw;                    // index of the car in scene_draws
+    int scene_tree_commands;               // first of the NUM_OF_TREE_OBJS commands with random trees
+    int scene_uploaded_trees = -1;         // num_of_trees the tree commands were uploaded for
+    double submission_time = 0.0;          // averaged CPU time of submitting the scene [ms]
+
+    // Benchmark run, the camera flies a fixed path with a fixed time step and the report is written after the last frame
+    int benchmark_frames = 0;                               // set by --benchmark=, 0 when running interactively
+    std::filesystem::path benchmark_report = "car_scene_benchmark"; // set by --benchmark-report=, without extension
+    BenchmarkRecorder benchmark_recorder;
+    GpuTimer gpu_timer;                                     // GPU time of render() in the benchmark run
+    uint32_t frame_draw_calls = 0;   // draw and dispatch calls of the current frame
+    uint64_t frame_upload_bytes = 0; // bytes written into buffers in the current frame
+
+    // GPU frustum and distance culling of the indirect draws
+    bool gpu_culling = false;
+    float cull_distance = 60.f;
+    GLuint scene_instance_commands_buffer = 0; // command of each entry in scene_draws
+    GLuint scene_command_bounds_buffer = 0;    // bounding sphere of the mesh of each command
+    GLuint scene_empty_commands_buffer = 0;    // scene_commands with zero instances, resets the culled commands
+    GLuint culled_commands_buffer = 0;         // commands with only the visible instances
+    GLuint visible_instances_buffer = 0;       // visible entries of scene_draws, starting at base_instance of each command
+    GLuint cull_stats_buffer = 0;
+    GLuint cull_stats_readback_buffer = 0;     // persistently mapped copy of cull_stats_buffer
+    CullStatsSSBO* cull_stats_readback = nullptr;
+    GLsync cull_stats_fence = nullptr;         // signalled once the copy to cull_stats_readback_buffer is done
+    CullStatsSSBO cull_stats = {0, 0};
+
+    // Clustered lighting, main.frag evaluates only the lights assigned to the cluster of the fragment
+    bool clustered_lighting = false;
+    GLuint cluster_counts_buffer = 0;
+    GLuint cluster_lights_buffer = 0;
+    GLuint cluster_stats_buffer = 0;
+    GLuint cluster_stats_readback_buffer = 0;  // persistently mapped copy of cluster_stats_buffer
+    ClusterStatsSSBO* cluster_stats_readback = nullptr;
+    GLsync cluster_stats_fence = nullptr;      // signalled once the copy to cluster_stats_readback_buffer is done
+    ClusterStatsSSBO cluster_stats = {0, 0};
 
 #ifdef SOUND
     // Sound variables
@@ -178,14 +430,17 @@ class Application : public PV112Application {
     GLuint car_buffer = 0;
 
     std::vector<LightUBO> lights;
-    GLuint lights_buffer = 0;
+    DynamicBuffer lights_buffer;
 
     std::vector<ObjectUBO> objects_ubos;
-    GLuint objects_buffer = 0;
+    DynamicBuffer objects_buffer;
 
     FogUBO fog_ubo;
     GLuint fog_buffer = 0;
 
+    FrameUBO frame_ubo = {};
+    GLuint frame_buffer = 0;
+
     // Player variables
     float delta_time = 0.0f; // Time between current frame and last frame
     float last_frame = 0.0f; // Time of last frame
@@ -203,6 +458,12 @@ class Application : public PV112Application {
     GLuint tree_textures[NUM_OF_TREE_OBJS];
     GLuint house_textures[NUM_OF_HOUSES];
 
+    // All loaded 2D textures, the sampling policy below is applied to them by apply_texture_policy
+    std::vector<texture_record> texture_records;
+    float texture_anisotropy = 8.0f;     // set by --anisotropy=, clamped to max_texture_anisotropy
+    float texture_lod_bias = 0.0f;       // set by --lod-bias=
+    float max_texture_anisotropy = 1.0f; // limit of the driver
+
     // Global booleans
     bool p_view = true;
     bool first_mouse = true;
@@ -280,5 +541,41 @@ class Application : public PV112Application {
 
     float rand_float(float low, float high);
 
-    unsigned int load_cubemap(std::vector<std::string> faces);
+    /**
+     * Bridson's Poisson-disk sampling of a rectangle, accelerated by a background grid.
+     * Runs in time linear to the number of generated samples and stops once the area is full.
+     *
+     * @param 	min 	The lower corner of the sampled rectangle.
+     * @param 	max 	The upper corner of the sampled rectangle.
+     * @param 	gap 	The minimal distance between two samples.
+     * @param 	seed	The seed of the random generator, the same seed gives the same samples.
+     */
+    std::vector<glm::vec2> poisson_disk_sample(glm::vec2 min, glm::vec2 max, float gap, unsigned int seed);
+
+    /** Returns how many random trees of the bucket are enabled by the Trees slider. */
+    GLsizei visible_trees(int bucket) const;
+
+    /** Merges all geometries into one vertex and index buffer, so that they can be drawn by one indirect call. */
+    void build_scene_mesh();
+
+    /** Builds the indirect commands and per-instance data of all objects drawn by main_program. */
+    void build_scene_commands();
+
+    /** Culls the scene instances against the camera frustum and cull_distance, fills culled_commands_buffer. */
+    void cull_scene();
+
+    /** Returns the index of the texture in scene_textures, the texture is appended if it is not there yet. */
+    int scene_texture_slot(GLuint texture);
+
+    /** Records the frame of the benchmark run, writes the report and closes the window after the last frame. */
+    void finish_benchmark_frame(double cpu_ms);
+
+    /** Sets the anisotropy and LOD bias of all texture_records to the current policy. */
+    void apply_texture_policy();
+
+    /** Draws count instances of the geometry, the instances are told apart by gl_InstanceID. */
+    void draw_instanced(const Geometry& geometry, GLsizei count);
+
+    /** Creates the immutable BC7 cubemap of the faces. Without the cubemap cache the faces are compressed and the cache is written. Falls back to RGBA8 when the driver does not compress. */
+    texture_record load_cubemap(const std::vector<std::filesystem::path>& face_paths, const CubemapData& data);
 };
@@ -10,7 +10,17 @@ layout(location = 1) in vec3 fs_color;
 // Fog factor for computing fog.
 layout(location = 10) in float fog_factor;
 
-layout(location = 3) uniform bool fog_on = false;
+// The settings shared by the whole frame, uploaded only when they change.
+layout(binding = 6, std140) uniform Frame {
+	vec2 screen_size; // used for finding the cluster of the fragment
+	bool toon_shading_on;
+	int toon_levels;
+	bool fog_on;
+	bool night_vision;
+	bool light_on;
+	int blinking_light;
+	bool clustered;
+} frame;
 
 layout(binding = 3, std140) uniform Fog {
 	vec4 color;
@@ -32,7 +42,7 @@ void main()
     vec3 result = fs_color / (fs_color + 1.0); // tone mapping
     result = pow(result, vec3(1.0 / 2.2));     // gamma correction
 
-    if (fog_on) {
+    if (frame.fog_on) {
         result = mix(vec3(fog.color), result, fog_factor);
     }
 
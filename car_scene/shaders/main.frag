@@ -1,5 +1,13 @@
 #version 450
 
+// Must match clusters.comp and application.hpp
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 9
+#define CLUSTERS_Z 24
+#define MAX_CLUSTER_LIGHTS 64
+// The depth where the last slice starts, the first one starts at the near plane of the camera.
+#define CLUSTER_FAR 100.0
+
 // ----------------------------------------------------------------------------
 // Structs
 // ----------------------------------------------------------------------------
@@ -29,13 +37,13 @@ layout(binding = 1, std430) buffer Lights {
 	Light lights[];
 };
 
-layout(binding = 2, std140) uniform Object {
-    mat4 model_matrix;
-
-    vec4 ambient_color;
-    vec4 diffuse_color;
-    vec4 specular_color;
-} object;
+// The lights reaching each cluster, filled by clusters.comp.
+layout(binding = 13, std430) readonly buffer ClusterCounts {
+	uint cluster_counts[];
+};
+layout(binding = 14, std430) readonly buffer ClusterLights {
+	uint cluster_lights[];
+};
 
 layout(binding = 3, std140) uniform Fog {
 	vec4 color;
@@ -48,22 +56,32 @@ layout(location = 0) in vec3 fs_position;
 layout(location = 1) in vec3 fs_normal;
 // The coordinates in texture from the vertex shader.
 layout(location = 2) in vec2 fs_texture_coordinate;
+// The material of the object from the vertex shader.
+layout(location = 3) flat in vec4 fs_ambient_color;
+layout(location = 4) flat in vec4 fs_diffuse_color;
+layout(location = 5) flat in vec4 fs_specular_color;
+// Texture scale (xy), texture flag (z) and index into albedo_textures (w) from the vertex shader.
+layout(location = 6) flat in vec4 fs_texture_params;
 // Fog factor for computing fog.
 layout(location = 10) in float fog_factor;
 
-// Texture variables
-layout(location = 3) uniform bool has_texture = false;
-layout(location = 4) uniform vec2 texture_scale;
-layout(binding = 4) uniform sampler2D albedo_texture;
-
-// Uniform bools
-layout(location = 5) uniform bool toon_shading_on = false;
-layout(location = 6) uniform bool light_on = true;
-layout(location = 11) uniform bool fog_on = false;
-
-// Other variables
-layout(location = 7) uniform int blinking_light = 5;
-layout(location = 8) uniform int toon_levels = 10;
+// Texture variables, only the first one is used when not drawing indirectly.
+// The index must be dynamically uniform: build_scene_commands gives every indirect command a single texture,
+// so the flat index is the same for all fragments of one draw of the multi-draw.
+// The size must match NUM_OF_SCENE_TEXTURES in application.hpp, it has headroom above the textures the scene uses.
+layout(binding = 4) uniform sampler2D albedo_textures[20];
+
+// The settings shared by the whole frame, uploaded only when they change.
+layout(binding = 6, std140) uniform Frame {
+	vec2 screen_size; // used for finding the cluster of the fragment
+	bool toon_shading_on;
+	int toon_levels;
+	bool fog_on;
+	bool night_vision;
+	bool light_on;
+	int blinking_light;
+	bool clustered;
+} frame;
 
 // ----------------------------------------------------------------------------
 // Output Variables
@@ -74,7 +92,7 @@ layout(location = 0) out vec4 final_color;
 // ----------------------------------------------------------------------------
 // Functions
 // ----------------------------------------------------------------------------
-vec3 calc_light(Light light, vec3 N, vec3 E);
+vec3 calc_light(Light light, vec3 N, vec3 E, vec3 albedo);
 
 // ----------------------------------------------------------------------------
 // Main Method
@@ -83,30 +101,50 @@ void main() {
 	vec3 color_sum = vec3(0.0);
     vec3 N = normalize(fs_normal);
 	vec3 E = normalize(camera.position - fs_position); 
+	vec3 albedo = (fs_texture_params.z > 0.5) ?
+                  texture(albedo_textures[int(fs_texture_params.w)], fs_texture_coordinate * fs_texture_params.xy).rgb
+                  : vec3(1.0);
 	
-    // calculate all lights
-    for(int i = 0; i < lights.length(); i++) {
-        if (i != blinking_light + 1 || light_on) {
-	    	color_sum += calc_light(lights[i], N, E);
+    if (frame.clustered) {
+        // calculate only the lights reaching the cluster of this fragment
+        float depth = -(camera.view * vec4(fs_position, 1.0)).z;
+        // The near plane of the perspective projection, the same derivation is in clusters.comp
+        float cluster_near = camera.projection[3][2] / (camera.projection[2][2] - 1.0);
+        float slice = log(max(depth, cluster_near) / cluster_near) / log(CLUSTER_FAR / cluster_near) * CLUSTERS_Z;
+        uvec2 tile = uvec2(min(gl_FragCoord.xy / frame.screen_size * vec2(CLUSTERS_X, CLUSTERS_Y), vec2(CLUSTERS_X - 1, CLUSTERS_Y - 1)));
+        uint cluster = (uint(min(slice, CLUSTERS_Z - 1)) * CLUSTERS_Y + tile.y) * CLUSTERS_X + tile.x;
+
+        for (uint k = 0; k < cluster_counts[cluster]; k++) {
+            uint i = cluster_lights[cluster * MAX_CLUSTER_LIGHTS + k];
+            if (i != frame.blinking_light + 1 || frame.light_on) {
+                color_sum += calc_light(lights[i], N, E, albedo);
+            }
+        }
+    } else {
+        // calculate all lights
+        for(int i = 0; i < lights.length(); i++) {
+            if (i != frame.blinking_light + 1 || frame.light_on) {
+                color_sum += calc_light(lights[i], N, E, albedo);
+            }
         }
     }
 
     color_sum = color_sum / (color_sum + 1.0);   // tone mapping
     color_sum = pow(color_sum, vec3(1.0 / 2.2)); // gamma correction
 
-    if (fog_on) {
+    if (frame.fog_on) {
         color_sum = mix(vec3(fog.color), color_sum, fog_factor);
     }
 
-    if (toon_shading_on) {
-        int level = toon_levels;
+    if (frame.toon_shading_on) {
+        int level = frame.toon_levels;
         final_color = vec4(round(color_sum * level) / level, 1.0);
     } else {
         final_color = vec4(color_sum, 1.0);
     }
 }
 
-vec3 calc_light(Light light, vec3 N, vec3 E) {
+vec3 calc_light(Light light, vec3 N, vec3 E, vec3 albedo) {
     vec3 light_vector = light.position.xyz - fs_position * light.position.w;
 	vec3 L = normalize(light_vector);
 	vec3 H = normalize(L + E);
@@ -121,18 +159,12 @@ vec3 calc_light(Light light, vec3 N, vec3 E) {
         intensity = clamp((theta - light.cut_off.y) / epsilon, 0.0, 1.0);
     }
 	
-	vec3 ambient = object.ambient_color.rgb * light.ambient_color.rgb * intensity *
-                   ((has_texture) ? 
-                   texture(albedo_texture, vec2(fs_texture_coordinate.x * texture_scale.x, fs_texture_coordinate.y * texture_scale.y)).rgb 
-                   : vec3(1.0));
-	vec3 diffuse = object.diffuse_color.rgb * light.diffuse_color.rgb * intensity *
-                   ((has_texture) ? 
-                   texture(albedo_texture, vec2(fs_texture_coordinate.x * texture_scale.x, fs_texture_coordinate.y * texture_scale.y)).rgb 
-                   : vec3(1.0));
-	vec3 specular = object.specular_color.rgb * light.specular_color.rgb * intensity;
+	vec3 ambient = fs_ambient_color.rgb * light.ambient_color.rgb * intensity * albedo;
+	vec3 diffuse = fs_diffuse_color.rgb * light.diffuse_color.rgb * intensity * albedo;
+	vec3 specular = fs_specular_color.rgb * light.specular_color.rgb * intensity;
 	vec3 color = ambient.rgb
 		+ NdotL * diffuse.rgb
-		+ pow(NdotH, object.specular_color.w) * specular;
+		+ pow(NdotH, fs_specular_color.w) * specular;
 	color /= dot(light_vector, light_vector);
 
     return color;
@@ -1,4 +1,5 @@
 #version 450
+#extension GL_ARB_shader_draw_parameters : enable
 
 #define LOG2 (1.442695)
 
@@ -42,6 +43,40 @@ layout(binding = 3, std140) uniform Fog {
 	float density;
 } fog;
 
+// The model matrices of instanced trees, grouped by the tree mesh.
+layout(binding = 5, std430) buffer TreeInstances {
+	mat4 tree_instances[];
+};
+
+// The object info of one instance drawn by glMultiDrawElementsIndirect.
+struct DrawData {
+	mat4 model_matrix;
+	vec4 ambient_color;
+	vec4 diffuse_color;
+	vec4 specular_color;
+	vec4 texture_params; // xy - texture scale, z - has texture, w - index into albedo_textures
+};
+layout(binding = 6, std430) buffer SceneDraws {
+	DrawData draws[];
+};
+
+// Indices into draws of the instances that survived culling, see cull.comp.
+layout(binding = 7, std430) readonly buffer VisibleInstances {
+	uint visible_instances[];
+};
+
+// Texture variables
+layout(location = 3) uniform bool has_texture = false;
+layout(location = 4) uniform vec2 texture_scale;
+
+// Instanced drawing reads the model matrix from tree_instances instead of object.
+layout(location = 12) uniform bool instanced = false;
+layout(location = 13) uniform int instance_offset = 0;
+// Indirect drawing reads the whole object info from draws instead of object.
+layout(location = 14) uniform bool indirect = false;
+// Culled indirect drawing reaches draws through visible_instances.
+layout(location = 15) uniform bool culling = false;
+
 // The position of the current vertex that is being processed.
 layout(location = 0) in vec3 position;
 // The normal of the current vertex that is being processed.
@@ -58,6 +93,12 @@ layout(location = 0) out vec3 fs_position;
 layout(location = 1) out vec3 fs_normal;
 // The texture coordinations forwared to fragment shader.
 layout(location = 2) out vec2 fs_texture_coordinate;
+// The material forwarded to fragment shader.
+layout(location = 3) flat out vec4 fs_ambient_color;
+layout(location = 4) flat out vec4 fs_diffuse_color;
+layout(location = 5) flat out vec4 fs_specular_color;
+// Texture scale, texture flag and texture index forwarded to fragment shader.
+layout(location = 6) flat out vec4 fs_texture_params;
 // Fog factor forwarded to fragment shader.
 layout(location = 10) out float fog_factor;
 
@@ -66,7 +107,29 @@ layout(location = 10) out float fog_factor;
 // ----------------------------------------------------------------------------
 void main()
 {
-	vec3 tmp_position = vec3(object.model_matrix * vec4(position, 1.f));
+	mat4 model_matrix = object.model_matrix;
+	fs_ambient_color = object.ambient_color;
+	fs_diffuse_color = object.diffuse_color;
+	fs_specular_color = object.specular_color;
+	fs_texture_params = vec4(texture_scale, (has_texture) ? 1.0 : 0.0, 0.0);
+
+	// The application keeps indirect drawing off when the extension is missing
+#ifdef GL_ARB_shader_draw_parameters
+	if (indirect) {
+		uint draw_index = uint(gl_BaseInstanceARB + gl_InstanceID);
+		DrawData draw = draws[(culling) ? visible_instances[draw_index] : draw_index];
+		model_matrix = draw.model_matrix;
+		fs_ambient_color = draw.ambient_color;
+		fs_diffuse_color = draw.diffuse_color;
+		fs_specular_color = draw.specular_color;
+		fs_texture_params = draw.texture_params;
+	} else
+#endif
+	if (instanced) {
+		model_matrix = tree_instances[instance_offset + gl_InstanceID];
+	}
+
+	vec3 tmp_position = vec3(model_matrix * vec4(position, 1.f));
 	fs_position = tmp_position;
 	vec3 cam_pos = vec3(camera.projection * camera.view * vec4(camera.position, 1.f));
 
@@ -76,9 +139,9 @@ void main()
 	float dist_sq = fog_frag_coord * fog_frag_coord;
 	fog_factor = exp2(-density_sq * dist_sq * LOG2);
 
-	fs_normal = transpose(inverse(mat3(object.model_matrix))) * normal;
+	fs_normal = transpose(inverse(mat3(model_matrix))) * normal;
 
     fs_texture_coordinate = texture_coordinate;
 
-    gl_Position = camera.projection * camera.view * object.model_matrix * vec4(position, 1.0);
+    gl_Position = camera.projection * camera.view * model_matrix * vec4(position, 1.0);
 }
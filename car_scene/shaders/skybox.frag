@@ -21,9 +21,17 @@ layout(binding = 4) uniform samplerCube skybox;
 
 layout(location = 0) in vec3 tex_coords;
 
-layout(location = 3) uniform bool fog_on = false;
-
-layout(location = 15) uniform bool night_vision = false;
+// The settings shared by the whole frame, uploaded only when they change.
+layout(binding = 6, std140) uniform Frame {
+	vec2 screen_size; // used for finding the cluster of the fragment
+	bool toon_shading_on;
+	int toon_levels;
+	bool fog_on;
+	bool night_vision;
+	bool light_on;
+	int blinking_light;
+	bool clustered;
+} frame;
 
 // ----------------------------------------------------------------------------
 // Output Variables
@@ -33,9 +41,9 @@ layout(location = 0) out vec4 final_color;
 
 void main()
 {    
-	if (fog_on) {
+	if (frame.fog_on) {
 		final_color = vec4(fog.color);
 	} else {
-    	final_color = vec4(vec3(texture(skybox, tex_coords)) - (night_vision ? 0.f : .3f), 1.f);
+    	final_color = vec4(vec3(texture(skybox, tex_coords)) - (frame.night_vision ? 0.f : .3f), 1.f);
 	}
 }
\ No newline at end of file
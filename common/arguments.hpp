@@ -0,0 +1,23 @@
+#pragma once
+
+#include <charconv>
+#include <iostream>
+#include <string>
+
+// Parses the numeric value of the command line argument in the form <prefix><value>, e.g. --benchmark=600.
+// Returns false when the argument has a different prefix, prints a message and keeps the value when the number is invalid.
+template <typename T> bool parse_argument(const std::string& argument, const std::string& prefix, T& value) {
+    if (argument.rfind(prefix, 0) != 0) {
+        return false;
+    }
+    const char* first = argument.data() + prefix.size();
+    const char* last = argument.data() + argument.size();
+    T parsed{};
+    auto [end, error] = std::from_chars(first, last, parsed);
+    if (error != std::errc() || end != last || first == last) {
+        std::cerr << "Invalid number in " << argument << ", the argument is ignored\n";
+        return false;
+    }
+    value = parsed;
+    return true;
+}
@@ -0,0 +1,134 @@
+#include "benchmark.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+void BenchmarkRecorder::add_frame(double cpu_ms, uint32_t draw_calls, uint64_t upload_bytes) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (samples.size() <= recorded) {
+        samples.resize(recorded + 1);
+    }
+    BenchmarkSample& sample = samples[recorded];
+    sample.frame_ms = (recorded == 0) ? 0.0 : std::chrono::duration<double, std::milli>(now - last_frame).count();
+    sample.cpu_ms = cpu_ms;
+    sample.draw_calls = draw_calls;
+    sample.upload_bytes = upload_bytes;
+    recorded++;
+    last_frame = now;
+}
+
+void BenchmarkRecorder::set_gpu_time(uint64_t frame, double gpu_ms) {
+    // The query of the frame being rendered may resolve before the frame is recorded
+    if (samples.size() <= frame) {
+        samples.resize(size_t(frame) + 1);
+    }
+    samples[size_t(frame)].gpu_ms = gpu_ms;
+}
+
+void BenchmarkRecorder::write_report(const std::filesystem::path& report, const char* application) const {
+    std::vector<BenchmarkSample> frames(samples.begin(), samples.begin() + std::min(samples.size(), recorded));
+    {
+        std::filesystem::path csv_path = report;
+        csv_path += ".csv";
+        std::ofstream csv(csv_path);
+        csv << "frame,frame_ms,cpu_ms,gpu_ms,draw_calls,upload_bytes\n";
+        for (size_t i = 0; i < frames.size(); i++) {
+            const BenchmarkSample& sample = frames[i];
+            csv << i << "," << sample.frame_ms << "," << sample.cpu_ms << "," << sample.gpu_ms << "," << sample.draw_calls << ","
+                << sample.upload_bytes << "\n";
+        }
+    }
+
+    std::vector<BenchmarkSample> measured(frames.begin() + std::min(frames.size(), size_t(BENCHMARK_WARMUP_FRAMES)), frames.end());
+    auto statistics = [&measured](double BenchmarkSample::*field) {
+        std::vector<double> values;
+        for (const BenchmarkSample& sample : measured) {
+            values.push_back(sample.*field);
+        }
+        std::sort(values.begin(), values.end());
+        double mean = 0.0;
+        for (double value : values) {
+            mean += value / values.size();
+        }
+        auto percentile = [&values](double p) { return values.empty() ? 0.0 : values[size_t(p * (values.size() - 1))]; };
+        std::ostringstream json;
+        json << "{\"mean\": " << mean << ", \"p50\": " << percentile(0.5) << ", \"p95\": " << percentile(0.95)
+             << ", \"max\": " << percentile(1.0) << "}";
+        return json.str();
+    };
+    double draw_calls = 0.0;
+    double upload_bytes = 0.0;
+    for (const BenchmarkSample& sample : measured) {
+        draw_calls += double(sample.draw_calls) / measured.size();
+        upload_bytes += double(sample.upload_bytes) / measured.size();
+    }
+
+    std::filesystem::path json_path = report;
+    json_path += ".json";
+    std::ofstream json(json_path);
+    json << "{\n"
+         << "  \"application\": \"" << application << "\",\n"
+         << "  \"frames\": " << frames.size() << ",\n"
+         << "  \"warmup_frames\": " << frames.size() - measured.size() << ",\n"
+         << "  \"time_step_ms\": " << BENCHMARK_TIME_STEP_MS << ",\n"
+         << "  \"frame_ms\": " << statistics(&BenchmarkSample::frame_ms) << ",\n"
+         << "  \"cpu_ms\": " << statistics(&BenchmarkSample::cpu_ms) << ",\n"
+         << "  \"gpu_ms\": " << statistics(&BenchmarkSample::gpu_ms) << ",\n"
+         << "  \"draw_calls\": " << draw_calls << ",\n"
+         << "  \"upload_bytes\": " << upload_bytes << "\n"
+         << "}\n";
+    std::cout << "Benchmark report written to " << json_path.generic_string() << "\n";
+}
+
+void GpuTimer::create(std::function<void(uint64_t frame, double ms)> resolved) {
+    this->resolved = std::move(resolved);
+    glCreateQueries(GL_TIMESTAMP, FRAMES * 2, &queries[0][0]);
+}
+
+void GpuTimer::destroy() { glDeleteQueries(FRAMES * 2, &queries[0][0]); }
+
+void GpuTimer::begin(uint64_t frame) {
+    // All queries are in flight only when the GPU is FRAMES frames behind, then the oldest one has to be waited for
+    if (!collect() && issued - read == FRAMES) {
+        resolve_oldest();
+    }
+    frames[issued % FRAMES] = frame;
+    glQueryCounter(queries[issued % FRAMES][0], GL_TIMESTAMP);
+}
+
+void GpuTimer::end() {
+    glQueryCounter(queries[issued % FRAMES][1], GL_TIMESTAMP);
+    issued++;
+}
+
+bool GpuTimer::collect() {
+    bool updated = false;
+    while (read < issued) {
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(queries[read % FRAMES][1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available == GL_FALSE) {
+            break;
+        }
+        resolve_oldest();
+        updated = true;
+    }
+    return updated;
+}
+
+void GpuTimer::flush() {
+    while (read < issued) {
+        resolve_oldest();
+    }
+}
+
+void GpuTimer::resolve_oldest() {
+    GLuint64 start_time, end_time;
+    glGetQueryObjectui64v(queries[read % FRAMES][0], GL_QUERY_RESULT, &start_time);
+    glGetQueryObjectui64v(queries[read % FRAMES][1], GL_QUERY_RESULT, &end_time);
+    uint64_t frame = frames[read % FRAMES];
+    read++;
+    if (resolved) {
+        resolved(frame, static_cast<double>(end_time - start_time) * 1e-6);
+    }
+}
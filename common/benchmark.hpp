@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <glad/glad.h>
+#include <vector>
+
+// The fixed time step of the --benchmark run [ms] and the number of its first frames left out of the summary.
+const float BENCHMARK_TIME_STEP_MS = 1000.0f / 60.0f;
+const int BENCHMARK_WARMUP_FRAMES = 10;
+
+// The measurements of one frame of the --benchmark run.
+struct BenchmarkSample {
+    double frame_ms = 0.0;     // wall time since the previous frame
+    double cpu_ms = 0.0;       // time spent in render()
+    double gpu_ms = 0.0;       // GPU time of render() of this frame, filled in once its timer query resolves
+    uint32_t draw_calls = 0;   // draw and dispatch calls issued by the application
+    uint64_t upload_bytes = 0; // bytes written into buffers by the application in the frame
+};
+
+// Records the frames of the --benchmark run and writes their report.
+class BenchmarkRecorder {
+  public:
+    // Records the finished frame, its frame_ms is measured from the previous call.
+    void add_frame(double cpu_ms, uint32_t draw_calls, uint64_t upload_bytes);
+
+    // Stores the GPU time of the frame, which may be resolved a few frames after the frame was recorded.
+    void set_gpu_time(uint64_t frame, double gpu_ms);
+
+    // The number of recorded frames, which is also the index of the frame being rendered.
+    size_t frame_count() const { return recorded; }
+
+    // Writes <report>.csv with one row per frame and <report>.json with the summary of the frames after the warm-up.
+    void write_report(const std::filesystem::path& report, const char* application) const;
+
+  private:
+    std::vector<BenchmarkSample> samples;
+    size_t recorded = 0;
+    std::chrono::steady_clock::time_point last_frame;
+};
+
+// Measures the GPU time between begin() and end() with timestamp queries. The results are read without stalling
+// once available, a few frames later, and handed to the callback with the frame they were issued in.
+class GpuTimer {
+  public:
+    // The number of frames that can be in flight before the oldest result has to be waited for.
+    static const int FRAMES = 4;
+
+    // Creates the queries, resolved receives the frame passed to begin() and the measured time [ms].
+    void create(std::function<void(uint64_t frame, double ms)> resolved);
+    void destroy();
+
+    void begin(uint64_t frame);
+    void end();
+
+    // Reads the finished frames without waiting, returns true when any was resolved.
+    bool collect();
+
+    // Waits for all frames in flight, e.g. before the benchmark report is written.
+    void flush();
+
+  private:
+    // Reads the oldest frame in flight, waits for it when it is not finished yet.
+    void resolve_oldest();
+
+    std::function<void(uint64_t frame, double ms)> resolved;
+    GLuint queries[FRAMES][2] = {};
+    // The frame passed to begin() for each query slot.
+    uint64_t frames[FRAMES] = {};
+    // The number of frames whose queries were issued.
+    uint64_t issued = 0;
+    // The number of frames whose results were read.
+    uint64_t read = 0;
+};
@@ -0,0 +1,134 @@
+#include "file_cache.hpp"
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::filesystem::path& filename) {
+#ifdef _WIN32
+    HANDLE handle = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    file = handle;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(handle, &file_size) || file_size.QuadPart == 0) {
+        return;
+    }
+    mapping = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping != nullptr) {
+        bytes = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        length = (bytes != nullptr) ? size_t(file_size.QuadPart) : 0;
+    }
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* view = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED) {
+            bytes = static_cast<const uint8_t*>(view);
+            length = size_t(info.st_size);
+        }
+    }
+    close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+    if (bytes != nullptr) {
+        UnmapViewOfFile(bytes);
+    }
+    if (mapping != nullptr) {
+        CloseHandle(mapping);
+    }
+    if (file != nullptr) {
+        CloseHandle(file);
+    }
+#else
+    if (bytes != nullptr) {
+        munmap(const_cast<uint8_t*>(bytes), length);
+    }
+#endif
+}
+
+bool source_stamp(const std::filesystem::path& filename, SourceStamp& stamp) {
+    std::error_code error;
+    uintmax_t size = std::filesystem::file_size(filename, error);
+    if (error) {
+        return false;
+    }
+    std::filesystem::file_time_type time = std::filesystem::last_write_time(filename, error);
+    if (error) {
+        return false;
+    }
+    stamp.size = uint64_t(size);
+    stamp.time = int64_t(time.time_since_epoch().count());
+    return true;
+}
+
+uint64_t fnv1a_hash(const uint8_t* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+std::filesystem::path cache_directory() {
+    std::filesystem::path directory = std::filesystem::current_path() / "cache";
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    return directory;
+}
+
+std::filesystem::path cache_path(const std::filesystem::path& filename, const char* extension) {
+    std::error_code error;
+    std::string source = std::filesystem::absolute(filename, error).generic_string();
+    std::ostringstream name;
+    name << filename.filename().string() << "-" << std::hex << std::setw(16) << std::setfill('0')
+         << fnv1a_hash(reinterpret_cast<const uint8_t*>(source.data()), source.size()) << extension;
+    return cache_directory() / name.str();
+}
+
+bool write_cache_file(const std::filesystem::path& cache, const std::function<void(std::ostream&)>& write) {
+    std::filesystem::path temporary = cache;
+    temporary += ".tmp";
+    std::error_code error;
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        if (file) {
+            write(file);
+            file.close();
+        }
+        if (!file) {
+            std::cout << "Failed to write cache " << cache.generic_string() << "\n";
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+    }
+    std::filesystem::rename(temporary, cache, error);
+    if (error) {
+        std::cout << "Failed to replace cache " << cache.generic_string() << ": " << error.message() << "\n";
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <ostream>
+
+// ----------------------------------------------------------------------------
+// File cache
+// ----------------------------------------------------------------------------
+// The caches of meshes and textures are stored in one cache directory, not next to the assets. A cache is
+// valid while the size and the modification time of its source are the ones stored in the cache, so
+// checking it never reads the source file.
+
+// Read-only memory mapping of a whole file, empty when the file cannot be mapped.
+class MappedFile {
+  public:
+    explicit MappedFile(const std::filesystem::path& filename);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+
+  private:
+    const uint8_t* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    void* file = nullptr;    // HANDLE of the file
+    void* mapping = nullptr; // HANDLE of the file mapping
+#endif
+};
+
+// Size and modification time of a source file.
+struct SourceStamp {
+    uint64_t size = 0;
+    int64_t time = 0;
+
+    bool operator==(const SourceStamp& other) const { return size == other.size && time == other.time; }
+    bool operator!=(const SourceStamp& other) const { return !(*this == other); }
+};
+
+// Fills the stamp of the file, returns false when the file does not exist.
+bool source_stamp(const std::filesystem::path& filename, SourceStamp& stamp);
+
+// 64-bit FNV-1a hash.
+uint64_t fnv1a_hash(const uint8_t* data, size_t size);
+
+// Returns the directory with all caches, it is created when it does not exist.
+std::filesystem::path cache_directory();
+
+// Returns the cache of the source file with the given extension, e.g. cache/car.obj-1f3a...meshcache.
+// The name contains the hash of the absolute source path, so that sources with the same name do not collide.
+std::filesystem::path cache_path(const std::filesystem::path& filename, const char* extension);
+
+// Writes the cache under a temporary name and renames it when the whole file was written, so that an interrupted
+// write never leaves a valid looking cache. Returns false and removes the temporary file when writing or renaming fails.
+bool write_cache_file(const std::filesystem::path& cache, const std::function<void(std::ostream&)>& write);
@@ -0,0 +1,75 @@
+#include "mesh_cache.hpp"
+#include "file_cache.hpp"
+#include <cstring>
+
+struct MeshCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_size;
+    int64_t source_time;
+    uint32_t mode;
+    uint32_t position_count;
+    uint32_t normal_count;
+    uint32_t tex_coord_count;
+    uint32_t index_count;
+    uint32_t padding;
+};
+const char MESH_CACHE_MAGIC[4] = {'M', 'C', 'H', 'E'};
+const uint32_t MESH_CACHE_VERSION = 2;
+
+bool read_mesh_cache(const std::filesystem::path& filename, MeshData& mesh) {
+    SourceStamp stamp;
+    if (!source_stamp(filename, stamp)) {
+        return false;
+    }
+    MappedFile cache(cache_path(filename, ".meshcache"));
+    MeshCacheHeader header;
+    if (cache.size() < sizeof(MeshCacheHeader)) {
+        return false;
+    }
+    std::memcpy(&header, cache.data(), sizeof(MeshCacheHeader));
+    size_t payload = (size_t(header.position_count) + header.normal_count + header.tex_coord_count) * sizeof(float) +
+                     size_t(header.index_count) * sizeof(uint32_t);
+    if (std::memcmp(header.magic, MESH_CACHE_MAGIC, 4) != 0 || header.version != MESH_CACHE_VERSION ||
+        SourceStamp{header.source_size, header.source_time} != stamp || cache.size() != sizeof(MeshCacheHeader) + payload) {
+        return false;
+    }
+
+    const uint8_t* read = cache.data() + sizeof(MeshCacheHeader);
+    auto read_array = [&read](auto& array, uint32_t count) {
+        array.resize(count);
+        std::memcpy(array.data(), read, count * sizeof(array[0]));
+        read += count * sizeof(array[0]);
+    };
+    mesh.mode = header.mode;
+    read_array(mesh.positions, header.position_count);
+    read_array(mesh.normals, header.normal_count);
+    read_array(mesh.tex_coords, header.tex_coord_count);
+    read_array(mesh.indices, header.index_count);
+    return true;
+}
+
+bool write_mesh_cache(const std::filesystem::path& filename, const MeshData& mesh) {
+    SourceStamp stamp;
+    if (!source_stamp(filename, stamp)) {
+        return false;
+    }
+    MeshCacheHeader header = {{MESH_CACHE_MAGIC[0], MESH_CACHE_MAGIC[1], MESH_CACHE_MAGIC[2], MESH_CACHE_MAGIC[3]},
+                              MESH_CACHE_VERSION,
+                              stamp.size,
+                              stamp.time,
+                              uint32_t(mesh.mode),
+                              uint32_t(mesh.positions.size()),
+                              uint32_t(mesh.normals.size()),
+                              uint32_t(mesh.tex_coords.size()),
+                              uint32_t(mesh.indices.size()),
+                              0};
+
+    return write_cache_file(cache_path(filename, ".meshcache"), [&](std::ostream& file) {
+        file.write(reinterpret_cast<const char*>(&header), sizeof(MeshCacheHeader));
+        file.write(reinterpret_cast<const char*>(mesh.positions.data()), mesh.positions.size() * sizeof(float));
+        file.write(reinterpret_cast<const char*>(mesh.normals.data()), mesh.normals.size() * sizeof(float));
+        file.write(reinterpret_cast<const char*>(mesh.tex_coords.data()), mesh.tex_coords.size() * sizeof(float));
+        file.write(reinterpret_cast<const char*>(mesh.indices.data()), mesh.indices.size() * sizeof(uint32_t));
+    });
+}
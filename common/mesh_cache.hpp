@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <glad/glad.h>
+#include <vector>
+
+// CPU side of a mesh, the arrays are the same as in Geometry.
+struct MeshData {
+    GLenum mode = GL_TRIANGLES;
+    std::vector<float> positions;
+    std::vector<float> normals;
+    std::vector<float> tex_coords;
+    std::vector<uint32_t> indices;
+};
+
+// ----------------------------------------------------------------------------
+// Mesh cache
+// ----------------------------------------------------------------------------
+// Binary copy of a parsed .obj stored in the cache directory (see file_cache.hpp) as <name>.obj-<hash>.meshcache:
+// MeshCacheHeader followed by positions, normals, tex_coords (floats) and indices (uint32). The cache is used only
+// while the size and the modification time of the .obj and the version match.
+
+// Fills the mesh from the cache of the .obj, returns false when the cache is missing, stale or damaged.
+bool read_mesh_cache(const std::filesystem::path& filename, MeshData& mesh);
+
+// Writes the cache of the .obj, returns false when the cache could not be written.
+bool write_mesh_cache(const std::filesystem::path& filename, const MeshData& mesh);
@@ -0,0 +1,313 @@
+#include "texture_cache.hpp"
+#include "file_cache.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+struct DDSHeader {
+    uint32_t magic;
+    uint32_t size;
+    uint32_t flags;
+    uint32_t height;
+    uint32_t width;
+    uint32_t pitch_or_linear_size;
+    uint32_t depth;
+    uint32_t mip_map_count;
+    uint32_t reserved1[11];
+    uint32_t pixel_format_size;
+    uint32_t pixel_format_flags;
+    uint32_t four_cc;
+    uint32_t pixel_format_reserved[5];
+    uint32_t caps[4];
+    uint32_t reserved2;
+    // DDS_HEADER_DXT10
+    uint32_t dxgi_format;
+    uint32_t resource_dimension;
+    uint32_t misc_flag;
+    uint32_t array_size;
+    uint32_t misc_flags2;
+};
+static_assert(sizeof(DDSHeader) == 148, "DDS magic, DDS_HEADER and DDS_HEADER_DXT10 are 148 bytes");
+const uint32_t DDS_MAGIC = 0x20534444;       // "DDS "
+const uint32_t DDS_FOURCC_DX10 = 0x30315844; // "DX10"
+
+// Layout of reserved1: version of the cache, the source size and the source modification time (low and high words).
+// A cubemap cache stores the hash of the sizes and modification times of its six faces instead of the source fields.
+const uint32_t TEXTURE_CACHE_VERSION = 2;
+enum TextureCacheField {
+    cache_version,
+    source_size_low,
+    source_size_high,
+    source_time_low,
+    source_time_high,
+    faces_hash_low = source_size_low,
+    faces_hash_high = source_size_high
+};
+const uint32_t DDS_MISC_TEXTURECUBE = 0x4;
+const uint32_t DDS_CAPS2_CUBEMAP_ALL_FACES = 0x200 | 0xFC00; // CUBEMAP and the six POSITIVE/NEGATIVE faces
+
+// The supported block formats: BC7 for colors, BC5 for normal maps (x and y only) and BC4 for single channel maps.
+struct BlockFormat {
+    GLenum format;
+    uint32_t dxgi_format;
+    size_t block_size;
+};
+const BlockFormat BLOCK_FORMATS[] = {
+    {GL_COMPRESSED_RGBA_BPTC_UNORM, 98, 16}, // BC7
+    {GL_COMPRESSED_RG_RGTC2, 83, 16},        // BC5
+    {GL_COMPRESSED_RED_RGTC1, 80, 8},        // BC4
+};
+
+const BlockFormat* find_block_format(GLenum format) {
+    for (const BlockFormat& block_format : BLOCK_FORMATS) {
+        if (block_format.format == format) {
+            return &block_format;
+        }
+    }
+    return nullptr;
+}
+
+size_t compressed_level_size(const BlockFormat& block_format, int width, int height) {
+    return size_t((width + 3) / 4) * size_t((height + 3) / 4) * block_format.block_size;
+}
+
+int mip_level_count(int width, int height) { return int(std::floor(std::log2(std::max(std::max(width, height), 1)))) + 1; }
+
+size_t compressed_chain_size(const BlockFormat& block_format, int width, int height, uint32_t levels) {
+    size_t size = 0;
+    for (uint32_t level = 0; level < levels; level++) {
+        size += compressed_level_size(block_format, std::max(width >> level, 1), std::max(height >> level, 1));
+    }
+    return size;
+}
+
+// Checks the parts of the header shared by the 2D and the cubemap caches.
+bool valid_header(const DDSHeader& header, const BlockFormat& block_format) {
+    return header.magic == DDS_MAGIC && header.four_cc == DDS_FOURCC_DX10 && header.dxgi_format == block_format.dxgi_format &&
+           header.reserved1[cache_version] == TEXTURE_CACHE_VERSION && header.width != 0 && header.height != 0 &&
+           int(header.mip_map_count) == mip_level_count(int(header.width), int(header.height));
+}
+
+// Copies the mip chain of one image from the cache, read points past it afterwards.
+void read_mip_chain(const uint8_t*& read, const BlockFormat& block_format, const DDSHeader& header, CompressedImage& image) {
+    image.format = block_format.format;
+    image.width = int(header.width);
+    image.height = int(header.height);
+    image.levels.resize(header.mip_map_count);
+    for (uint32_t level = 0; level < header.mip_map_count; level++) {
+        size_t size = compressed_level_size(block_format, std::max(image.width >> level, 1), std::max(image.height >> level, 1));
+        image.levels[level].assign(read, read + size);
+        read += size;
+    }
+}
+
+DDSHeader make_header(const CompressedImage& image) {
+    DDSHeader header = {};
+    header.magic = DDS_MAGIC;
+    header.size = 124;
+    header.flags = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000; // CAPS, HEIGHT, WIDTH, PIXELFORMAT, MIPMAPCOUNT, LINEARSIZE
+    header.height = uint32_t(image.height);
+    header.width = uint32_t(image.width);
+    header.pitch_or_linear_size = uint32_t(image.levels[0].size());
+    header.mip_map_count = uint32_t(image.levels.size());
+    header.reserved1[cache_version] = TEXTURE_CACHE_VERSION;
+    header.pixel_format_size = 32;
+    header.pixel_format_flags = 0x4; // FOURCC
+    header.four_cc = DDS_FOURCC_DX10;
+    header.caps[0] = 0x1000 | 0x400000 | 0x8; // TEXTURE, MIPMAP, COMPLEX
+    header.dxgi_format = find_block_format(image.format)->dxgi_format;
+    header.resource_dimension = 3; // TEXTURE2D
+    header.array_size = 1;
+    return header;
+}
+
+// Hashes the stamps of the faces, returns false when a face does not exist.
+bool faces_hash(const std::vector<std::filesystem::path>& face_paths, uint64_t& hash) {
+    std::vector<SourceStamp> stamps(face_paths.size());
+    for (size_t i = 0; i < face_paths.size(); i++) {
+        if (!source_stamp(face_paths[i], stamps[i])) {
+            return false;
+        }
+    }
+    hash = fnv1a_hash(reinterpret_cast<const uint8_t*>(stamps.data()), stamps.size() * sizeof(SourceStamp));
+    return true;
+}
+
+bool read_texture_cache(const std::filesystem::path& filename, GLenum format, CompressedImage& image) {
+    SourceStamp stamp;
+    const BlockFormat* block_format = find_block_format(format);
+    if (block_format == nullptr || !source_stamp(filename, stamp)) {
+        return false;
+    }
+
+    MappedFile cache(cache_path(filename, ".dds"));
+    DDSHeader header;
+    if (cache.size() < sizeof(DDSHeader)) {
+        return false;
+    }
+    std::memcpy(&header, cache.data(), sizeof(DDSHeader));
+    SourceStamp cached_stamp = {uint64_t(header.reserved1[source_size_low]) | (uint64_t(header.reserved1[source_size_high]) << 32),
+                                int64_t(uint64_t(header.reserved1[source_time_low]) | (uint64_t(header.reserved1[source_time_high]) << 32))};
+    if (!valid_header(header, *block_format) || cached_stamp != stamp || header.misc_flag != 0 ||
+        cache.size() != sizeof(DDSHeader) + compressed_chain_size(*block_format, int(header.width), int(header.height), header.mip_map_count)) {
+        return false;
+    }
+
+    const uint8_t* read = cache.data() + sizeof(DDSHeader);
+    read_mip_chain(read, *block_format, header, image);
+    return true;
+}
+
+bool write_texture_cache(const std::filesystem::path& filename, const CompressedImage& image) {
+    SourceStamp stamp;
+    if (!source_stamp(filename, stamp)) {
+        return false;
+    }
+    DDSHeader header = make_header(image);
+    header.reserved1[source_size_low] = uint32_t(stamp.size);
+    header.reserved1[source_size_high] = uint32_t(stamp.size >> 32);
+    header.reserved1[source_time_low] = uint32_t(uint64_t(stamp.time));
+    header.reserved1[source_time_high] = uint32_t(uint64_t(stamp.time) >> 32);
+
+    return write_cache_file(cache_path(filename, ".dds"), [&](std::ostream& file) {
+        file.write(reinterpret_cast<const char*>(&header), sizeof(DDSHeader));
+        for (const std::vector<uint8_t>& level : image.levels) {
+            file.write(reinterpret_cast<const char*>(level.data()), level.size());
+        }
+    });
+}
+
+bool read_cubemap_cache(const std::vector<std::filesystem::path>& face_paths, GLenum format, std::array<CompressedImage, 6>& faces) {
+    uint64_t hash = 0;
+    const BlockFormat* block_format = find_block_format(format);
+    if (block_format == nullptr || face_paths.size() != 6 || !faces_hash(face_paths, hash)) {
+        return false;
+    }
+
+    MappedFile cache(cache_path(face_paths[0], ".cube.dds"));
+    DDSHeader header;
+    if (cache.size() < sizeof(DDSHeader)) {
+        return false;
+    }
+    std::memcpy(&header, cache.data(), sizeof(DDSHeader));
+    uint64_t cached_hash = uint64_t(header.reserved1[faces_hash_low]) | (uint64_t(header.reserved1[faces_hash_high]) << 32);
+    if (!valid_header(header, *block_format) || cached_hash != hash || header.width != header.height ||
+        header.misc_flag != DDS_MISC_TEXTURECUBE || header.array_size != 1 ||
+        cache.size() != sizeof(DDSHeader) + 6 * compressed_chain_size(*block_format, int(header.width), int(header.height), header.mip_map_count)) {
+        return false;
+    }
+
+    const uint8_t* read = cache.data() + sizeof(DDSHeader);
+    for (CompressedImage& face : faces) {
+        read_mip_chain(read, *block_format, header, face);
+    }
+    return true;
+}
+
+bool write_cubemap_cache(const std::vector<std::filesystem::path>& face_paths, const std::array<CompressedImage, 6>& faces) {
+    uint64_t hash = 0;
+    if (face_paths.size() != 6 || !faces_hash(face_paths, hash)) {
+        return false;
+    }
+    DDSHeader header = make_header(faces[0]);
+    header.reserved1[faces_hash_low] = uint32_t(hash);
+    header.reserved1[faces_hash_high] = uint32_t(hash >> 32);
+    header.caps[1] = DDS_CAPS2_CUBEMAP_ALL_FACES;
+    header.misc_flag = DDS_MISC_TEXTURECUBE;
+
+    return write_cache_file(cache_path(face_paths[0], ".cube.dds"), [&](std::ostream& file) {
+        file.write(reinterpret_cast<const char*>(&header), sizeof(DDSHeader));
+        for (const CompressedImage& face : faces) {
+            for (const std::vector<uint8_t>& level : face.levels) {
+                file.write(reinterpret_cast<const char*>(level.data()), level.size());
+            }
+        }
+    });
+}
+
+std::vector<ImageData> build_mip_chain(ImageData base) {
+    std::vector<ImageData> mips;
+    mips.reserve(size_t(mip_level_count(base.width, base.height)));
+    mips.push_back(std::move(base));
+    while (mips.back().width > 1 || mips.back().height > 1) {
+        const ImageData& source = mips.back();
+        ImageData level;
+        level.width = std::max(source.width / 2, 1);
+        level.height = std::max(source.height / 2, 1);
+        level.channels = source.channels;
+        level.pixels.resize(size_t(level.width) * level.height * level.channels);
+        for (int y = 0; y < level.height; y++) {
+            int y0 = std::min(2 * y, source.height - 1);
+            int y1 = std::min(2 * y + 1, source.height - 1);
+            for (int x = 0; x < level.width; x++) {
+                int x0 = std::min(2 * x, source.width - 1);
+                int x1 = std::min(2 * x + 1, source.width - 1);
+                for (int c = 0; c < level.channels; c++) {
+                    auto texel = [&](int sx, int sy) { return int(source.pixels[(size_t(sy) * source.width + sx) * source.channels + c]); };
+                    int sum = texel(x0, y0) + texel(x1, y0) + texel(x0, y1) + texel(x1, y1);
+                    level.pixels[(size_t(y) * level.width + x) * level.channels + c] = static_cast<unsigned char>((sum + 2) / 4);
+                }
+            }
+        }
+        mips.push_back(std::move(level));
+    }
+    return mips;
+}
+
+CompressedImage compress_mip_chain(const std::vector<ImageData>& mips, GLenum format) {
+    // Online compression needs the mutable glTexImage2D, immutable storage accepts only compressed data
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    for (size_t level = 0; level < mips.size(); level++) {
+        glTexImage2D(GL_TEXTURE_2D, GLint(level), format, mips[level].width, mips[level].height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                     mips[level].pixels.data());
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // A driver without an encoder for the format may store the texture uncompressed, GL_TEXTURE_COMPRESSED tells
+    CompressedImage image;
+    GLint compressed = GL_FALSE;
+    GLint internal_format = 0;
+    glGetTextureLevelParameteriv(texture, 0, GL_TEXTURE_COMPRESSED, &compressed);
+    glGetTextureLevelParameteriv(texture, 0, GL_TEXTURE_INTERNAL_FORMAT, &internal_format);
+    if (compressed == GL_TRUE && GLenum(internal_format) == format) {
+        image.format = format;
+        image.width = mips[0].width;
+        image.height = mips[0].height;
+        image.levels.resize(mips.size());
+        for (size_t level = 0; level < mips.size(); level++) {
+            GLint size = 0;
+            glGetTextureLevelParameteriv(texture, GLint(level), GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+            image.levels[level].resize(size_t(size));
+            glGetCompressedTextureImage(texture, GLint(level), size, image.levels[level].data());
+        }
+    } else {
+        std::cout << "The driver does not compress into format 0x" << std::hex << format << std::dec << ", the texture stays RGBA8\n";
+    }
+    glDeleteTextures(1, &texture);
+    return image;
+}
+
+GLuint upload_compressed_texture(const CompressedImage& image) {
+    GLuint texture;
+    glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+    glTextureStorage2D(texture, GLsizei(image.levels.size()), image.format, image.width, image.height);
+    for (size_t level = 0; level < image.levels.size(); level++) {
+        glCompressedTextureSubImage2D(texture, GLint(level), 0, 0, std::max(image.width >> level, 1), std::max(image.height >> level, 1),
+                                      image.format, GLsizei(image.levels[level].size()), image.levels[level].data());
+    }
+    return texture;
+}
+
+GLuint upload_mip_chain(const std::vector<ImageData>& mips) {
+    GLuint texture;
+    glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+    glTextureStorage2D(texture, GLsizei(mips.size()), GL_RGBA8, mips[0].width, mips[0].height);
+    for (size_t level = 0; level < mips.size(); level++) {
+        glTextureSubImage2D(texture, GLint(level), 0, 0, mips[level].width, mips[level].height, GL_RGBA, GL_UNSIGNED_BYTE,
+                            mips[level].pixels.data());
+    }
+    return texture;
+}
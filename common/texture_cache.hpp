@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <glad/glad.h>
+#include <vector>
+
+// CPU side of an RGBA8 image.
+struct ImageData {
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    std::vector<unsigned char> pixels;
+};
+
+// Block-compressed mip chain of an image, as stored in its .dds texture cache.
+struct CompressedImage {
+    GLenum format = 0;
+    int width = 0;
+    int height = 0;
+    std::vector<std::vector<uint8_t>> levels;
+};
+
+// ----------------------------------------------------------------------------
+// Texture cache
+// ----------------------------------------------------------------------------
+// Block-compressed copy of an image stored in the cache directory (see file_cache.hpp) as <name>-<hash>.dds
+// (DX10 header) with the whole mip chain. The driver compresses the image on the first start and the blocks are
+// read back into the cache, later starts upload the blocks directly. Rows are kept bottom-up as OpenGL expects
+// them, so the files are not meant for other tools. The cache is valid while the size and the modification time
+// of the image, stored in the reserved fields of the header, match, the same policy as the mesh cache has.
+
+// Number of levels of a full mip chain, the last level is 1x1.
+int mip_level_count(int width, int height);
+
+// Fills the image from the cache, returns false when the cache is missing, stale, damaged or in another format.
+bool read_texture_cache(const std::filesystem::path& filename, GLenum format, CompressedImage& image);
+
+// Writes the cache of the image, returns false when the cache could not be written.
+bool write_texture_cache(const std::filesystem::path& filename, const CompressedImage& image);
+
+// ----------------------------------------------------------------------------
+// Cubemap cache
+// ----------------------------------------------------------------------------
+// The six block-compressed faces of a cubemap in one .dds stored as <first face>-<hash>.cube.dds, a DX10 header
+// with the TEXTURECUBE flag followed by the full mip chain of each face in the +X, -X, +Y, -Y, +Z, -Z order. The
+// header keeps the hash of the sizes and modification times of all six face images, the cache is valid while it
+// matches. The faces are square and of the same size.
+
+// Fills the faces from the cubemap cache with one mapped read, returns false when the cache is missing, stale,
+// damaged or in another format.
+bool read_cubemap_cache(const std::vector<std::filesystem::path>& face_paths, GLenum format, std::array<CompressedImage, 6>& faces);
+
+// Writes the cubemap cache of the faces, returns false when the cache could not be written.
+bool write_cubemap_cache(const std::vector<std::filesystem::path>& face_paths, const std::array<CompressedImage, 6>& faces);
+
+// Halves the RGBA image down to 1x1, each texel averages the (up to) 2x2 texels of the previous level.
+std::vector<ImageData> build_mip_chain(ImageData base);
+
+// Lets the driver compress the RGBA mip chain and reads the blocks back. Returns an empty image when the driver
+// does not report GL_TEXTURE_COMPRESSED for the result, the caller then keeps the chain as RGBA8 (upload_mip_chain).
+CompressedImage compress_mip_chain(const std::vector<ImageData>& mips, GLenum format);
+
+// Creates an immutable texture with the compressed mip chain.
+GLuint upload_compressed_texture(const CompressedImage& image);
+
+// Creates an immutable RGBA8 texture with the mip chain, the fallback for drivers that do not compress into the format.
+GLuint upload_mip_chain(const std::vector<ImageData>& mips);
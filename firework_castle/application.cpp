@@ -1,9 +1,119 @@
 #include "application.hpp"
+#include "../common/arguments.hpp"
+#include "../common/mesh_cache.hpp"
 #include "utils.hpp"
+#include <algorithm>
+#include <fstream>
 #include <map>
+#include <random>
+#include <sstream>
+
+// ----------------------------------------------------------------------------
+// Compute program
+// ----------------------------------------------------------------------------
+bool ComputeProgram::compile(const std::filesystem::path& filename, const std::vector<std::string>& defines) {
+    std::ifstream file(filename);
+    if (!file) {
+        std::cout << "Compute shader " << filename.generic_string() << " could not be opened.\n";
+        return false;
+    }
+    std::stringstream source;
+    source << file.rdbuf();
+    std::string code = source.str();
+    std::string define_lines;
+    for (const std::string& define : defines) {
+        define_lines += "#define " + define + "\n";
+    }
+    size_t version_end = code.find('\n', code.find("#version"));
+    code.insert(version_end == std::string::npos ? code.size() : version_end + 1, define_lines);
+    const char* code_ptr = code.data();
+
+    char log[1024];
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(shader, 1, &code_ptr, nullptr);
+    glCompileShader(shader);
+    GLint compiled;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+        glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        std::cout << "Compute shader " << filename.generic_string() << " failed to compile:\n" << log << "\n";
+        glDeleteShader(shader);
+        return false;
+    }
+
+    GLuint linked_program = glCreateProgram();
+    glAttachShader(linked_program, shader);
+    glLinkProgram(linked_program);
+    glDeleteShader(shader);
+    GLint linked;
+    glGetProgramiv(linked_program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        glGetProgramInfoLog(linked_program, sizeof(log), nullptr, log);
+        std::cout << "Compute program " << filename.generic_string() << " failed to link:\n" << log << "\n";
+        glDeleteProgram(linked_program);
+        return false;
+    }
+
+    destroy();
+    program = linked_program;
+    GLint uniform_count = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &uniform_count);
+    for (GLint i = 0; i < uniform_count; i++) {
+        char name[256];
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(program, GLuint(i), sizeof(name), nullptr, &size, &type, name);
+        locations[name] = glGetUniformLocation(program, name);
+    }
+    return true;
+}
+
+void ComputeProgram::destroy() {
+    glDeleteProgram(program);
+    program = 0;
+    locations.clear();
+}
+
+void ComputeProgram::use() const { glUseProgram(program); }
+
+void ComputeProgram::uniform(const char* name, float value) const { glProgramUniform1f(program, location(name), value); }
+
+void ComputeProgram::uniform(const char* name, int value) const { glProgramUniform1i(program, location(name), value); }
+
+GLint ComputeProgram::location(const char* name) const {
+    auto found = locations.find(std::string_view(name));
+    return found == locations.end() ? -1 : found->second;
+}
 
 Application::Application(int initial_width, int initial_height, std::vector<std::string> arguments)
     : PV227Application(initial_width, initial_height, arguments) {
+    for (const std::string& argument : arguments) {
+        parse_argument(argument, "--benchmark=", benchmark_frames);
+        if (argument.rfind("--benchmark-report=", 0) == 0) {
+            benchmark_report = argument.substr(19);
+        }
+        if (argument == "--legacy-sync") {
+            legacy_sync = true;
+        }
+        if (parse_argument(argument, "--particles=", desired_particle_count)) {
+            desired_particle_count = glm::clamp(desired_particle_count, 1, max_particle_count);
+        }
+        if (parse_argument(argument, "--fireworks=", desired_fireworks_count)) {
+            desired_fireworks_count = glm::clamp(desired_fireworks_count, 1, MAX_FIREWORKS);
+        }
+        if (argument == "--packed-particles") {
+            packed_particles = true;
+        }
+        parse_argument(argument, "--local-size=", particle_local_size);
+    }
+
+    // The GPU time is shown as fps_gpu and written into the benchmark sample of the frame it was measured in
+    gpu_timer.create([this](uint64_t frame, double ms) {
+        fps_gpu = static_cast<float>(1000.0 / ms);
+        if (benchmark_frames > 0) {
+            benchmark_recorder.set_gpu_time(frame, ms);
+        }
+    });
     Application::compile_shaders();
     prepare_cameras();
     prepare_lights();
@@ -17,7 +127,12 @@ Application::Application(int initial_width, int initial_height, std::vector<std:
     glClearDepth(1.0);
 }
 
-Application::~Application() {}
+Application::~Application() {
+    gpu_timer.destroy();
+    update_particles_program.destroy();
+    light_partials_program.destroy();
+    finalize_light_program.destroy();
+}
 
 // ----------------------------------------------------------------------------
 // Shaderes
@@ -35,13 +150,34 @@ void Application::compile_shaders() {
     particle_textured_program.add_geometry_shader(lecture_shaders_path / "particle_textured.geom");
     particle_textured_program.link();
 
-    update_particles_program = ShaderProgram();
-    update_particles_program.add_compute_shader(lecture_shaders_path / "fireworks.comp");
-    update_particles_program.link();
+    compile_particle_programs();
 
     std::cout << "Shaders are reloaded." << std::endl;
 }
 
+void Application::compile_particle_programs() {
+    // The work group size can only be set when the shader is compiled, the supported sizes are powers of two.
+    if (particle_local_size != 64 && particle_local_size != 128 && particle_local_size != 256 && particle_local_size != 512) {
+        std::cout << "Unsupported work group size " << particle_local_size << ", using 256.\n";
+        particle_local_size = 256;
+    }
+
+    std::vector<std::string> layout_defines;
+    if (packed_particles) {
+        layout_defines.push_back("PACKED_PARTICLES");
+    }
+    std::vector<std::string> update_defines = layout_defines;
+    update_defines.push_back("LOCAL_SIZE_X " + std::to_string(particle_local_size));
+    std::vector<std::string> partials_defines = layout_defines;
+    partials_defines.push_back("CHUNK_SIZE " + std::to_string(LIGHT_CHUNK_SIZE));
+    std::vector<std::string> finalize_defines = layout_defines;
+    finalize_defines.push_back("FINALIZE");
+
+    update_particles_program.compile(lecture_shaders_path / "fireworks.comp", update_defines);
+    light_partials_program.compile(lecture_shaders_path / "fireworks_light.comp", partials_defines);
+    finalize_light_program.compile(lecture_shaders_path / "fireworks_light.comp", finalize_defines);
+}
+
 // ----------------------------------------------------------------------------
 // Initialize Scene
 // ----------------------------------------------------------------------------
@@ -61,9 +197,11 @@ void Application::prepare_cameras() {
 }
 
 void Application::prepare_lights(){
-    phong_lights_bo = PhongLightsUBO(100, GL_SHADER_STORAGE_BUFFER); // Note that we use SSBO
-    phong_lights_bo.add(PhongLightData::CreateDirectionalLight(glm::vec4(1,1,1,0), glm::vec3(0.1f), glm::vec3(0.9f), glm::vec3(0.1f)));
-    phong_lights_bo.update_opengl_data();
+    for (PhongLightsUBO& lights : phong_lights_bo) {
+        lights = PhongLightsUBO(100, GL_SHADER_STORAGE_BUFFER); // Note that we use SSBO
+        lights.add(PhongLightData::CreateDirectionalLight(glm::vec4(1,1,1,0), glm::vec3(0.1f), glm::vec3(0.9f), glm::vec3(0.1f)));
+        lights.update_opengl_data();
+    }
 }
 
 void Application::prepare_textures() {
@@ -142,31 +280,50 @@ void Application::resize_fullscreen_textures() {
     FBOUtils::check_framebuffer_status(reflection_buffer_fbo, "Reflection buffer");
 }
 
+Geometry Application::load_geometry(const std::filesystem::path& filename) {
+    double start = glfwGetTime();
+    MeshData mesh;
+    if (read_mesh_cache(filename, mesh)) {
+        std::cout << filename.filename().string() << " loaded from cache in " << (glfwGetTime() - start) * 1000.0 << " ms\n";
+        return Geometry(mesh.mode, mesh.positions, mesh.indices, mesh.normals, std::vector<float>(), mesh.tex_coords);
+    }
+
+    Geometry geometry = Geometry::from_file(filename);
+    std::cout << filename.filename().string() << " parsed in " << (glfwGetTime() - start) * 1000.0 << " ms\n";
+    write_mesh_cache(filename, {geometry.mode, geometry.positions, geometry.normals, geometry.tex_coords, geometry.indices});
+    return geometry;
+}
+
 void Application::prepare_scene() {
-    // Allocates GPU buffers.
-    glCreateBuffers(1, &particle_positions_bo);
-    glCreateBuffers(1, &particle_velocities_bo);
-    glCreateBuffers(1, &particle_colors_bo);
-    glNamedBufferStorage(particle_positions_bo, sizeof(float) * 4 * max_particle_count, nullptr, GL_DYNAMIC_STORAGE_BIT);
-    glNamedBufferStorage(particle_velocities_bo, sizeof(float) * 4 * max_particle_count, nullptr, GL_DYNAMIC_STORAGE_BIT);
-    glNamedBufferStorage(particle_colors_bo, sizeof(float) * 4 * max_particle_count, nullptr, GL_DYNAMIC_STORAGE_BIT);
-
-    // Initialize positions and velocities, and uploads them into OpenGL buffers.
-    current_particle_count = desired_particle_count;
-    reset_particles();
+    // Allocates GPU buffers, two copies of each. The buffers are only written on GPU.
+    glCreateBuffers(2, particle_positions_bo);
+    glCreateBuffers(2, particle_alive_bo);
+    // The draw elements indirect command - count, instance count, first index, base vertex, base instance - padded to
+    // 8 indices, the indices of the live particles follow it in the same buffer.
+    const GLuint draw_command[8] = {0, 1, 8, 0, 0, 0, 0, 0};
+    for (int i = 0; i < 2; i++) {
+        glNamedBufferStorage(particle_positions_bo[i], sizeof(float) * 4 * max_particle_count, nullptr, 0);
+        glNamedBufferStorage(particle_alive_bo[i], sizeof(draw_command) + sizeof(GLuint) * max_particle_count, nullptr, GL_DYNAMIC_STORAGE_BIT);
+        glNamedBufferSubData(particle_alive_bo[i], 0, sizeof(draw_command), draw_command);
+    }
+    // One partial sum per chunk of each rocket with a light. The rockets differ by at most one particle, so the lit
+    // rockets have at most MAX_FIREWORK_LIGHTS / fireworks of all particles, plus one partially filled chunk each.
+    glCreateBuffers(1, &particle_partials_bo);
+    glNamedBufferStorage(particle_partials_bo, sizeof(float) * 4 * (max_particle_count / LIGHT_CHUNK_SIZE + 2 * MAX_FIREWORK_LIGHTS), nullptr, 0);
 
-    // Creates VAOs to render the particles. The positions are at location '0' and the sizes at '1'.
-    glCreateVertexArrays(1, &particle_vao);
+    glCreateBuffers(1, &rockets_bo);
+    glNamedBufferStorage(rockets_bo, sizeof(Rocket) * MAX_FIREWORKS, nullptr, GL_DYNAMIC_STORAGE_BIT);
+    prepare_particle_buffers();
 
-    glVertexArrayVertexBuffer(particle_vao, 0, particle_positions_bo, 0, 4 * sizeof(float));
-    glEnableVertexArrayAttrib(particle_vao, 0);
-    glVertexArrayAttribFormat(particle_vao, 0, 4, GL_FLOAT, GL_FALSE, 0);
-    glVertexArrayAttribBinding(particle_vao, 0, 0);
+    // Clears the particles and fills the rocket table.
+    current_particle_count = desired_particle_count;
+    current_fireworks_count = desired_fireworks_count;
+    reset_particles();
+    prepare_rockets();
 
-    glVertexArrayVertexBuffer(particle_vao, 1, particle_colors_bo, 0, 4 * sizeof(float));
-    glEnableVertexArrayAttrib(particle_vao, 1);
-    glVertexArrayAttribFormat(particle_vao, 1, 4, GL_FLOAT, GL_FALSE, 0);
-    glVertexArrayAttribBinding(particle_vao, 1, 1);
+    // Creates the VAOs to render the particles, one for each copy of the particle buffers.
+    glCreateVertexArrays(2, particle_vao);
+    prepare_particle_vaos();
 
     outer_terrain_object = SceneObject(
         cube, ModelUBO(translate(glm::mat4(1.0f), glm::vec3(0.0f, -0.08f, 0.0f)) * scale(glm::mat4(1.0f), glm::vec3(13.0f, 0.1f, 13.0f))),
@@ -180,7 +337,7 @@ void Application::prepare_scene() {
         cube, ModelUBO(translate(glm::mat4(1.0f), glm::vec3(0.0f, -0.05f, 0.0f)) * scale(glm::mat4(1.0f), glm::vec3(12.f, 0.1f, 12.f))),
         blue_material_ubo);
 
-    Geometry castle = Geometry::from_file(lecture_folder_path / "models/castle2.obj");
+    Geometry castle = load_geometry(lecture_folder_path / "models/castle2.obj");
     castle_object = SceneObject(
         castle, ModelUBO(scale(translate(glm::mat4(1.0f), glm::vec3(0.0f, 1.06f, 0.0f)) * glm::mat4(1.0f), glm::vec3(7.f, 7.f, 7.f))),
         gray_material_ubo);
@@ -190,6 +347,13 @@ void Application::prepare_scene() {
 // Update
 // ----------------------------------------------------------------------------
 void Application::update(float delta) {
+    // The benchmark runs with a fixed time step and orbits the camera once around the castle.
+    if (benchmark_frames > 0) {
+        delta = BENCHMARK_TIME_STEP_MS;
+        float progress = float(benchmark_recorder.frame_count()) / benchmark_frames;
+        camera.set_eye_position(glm::radians(-45.f + 360.f * progress), glm::radians(20.f + 15.f * sinf(glm::radians(360.f * progress))),
+                                50.f - 20.f * progress);
+    }
     PV227Application::update(delta);
 
     // Updates the main camera.
@@ -208,23 +372,116 @@ void Application::update(float delta) {
     if (current_particle_count != desired_particle_count) {
         current_particle_count = desired_particle_count;
         reset_particles();
+        prepare_rockets();
+    }
+    if (current_fireworks_count != desired_fireworks_count) {
+        current_fireworks_count = desired_fireworks_count;
+        prepare_rockets();
     }
 
     update_particles_gpu(delta);
 }
 
+void Application::prepare_particle_buffers() {
+    // The packed layout keeps the whole particle in particle_positions_bo, the velocities and colors are only
+    // allocated for the unpacked layout.
+    glDeleteBuffers(2, particle_velocities_bo);
+    glDeleteBuffers(2, particle_colors_bo);
+    for (int i = 0; i < 2; i++) {
+        particle_velocities_bo[i] = 0;
+        particle_colors_bo[i] = 0;
+    }
+    if (!packed_particles) {
+        glCreateBuffers(2, particle_velocities_bo);
+        glCreateBuffers(2, particle_colors_bo);
+        for (int i = 0; i < 2; i++) {
+            glNamedBufferStorage(particle_velocities_bo[i], sizeof(float) * 4 * max_particle_count, nullptr, 0);
+            glNamedBufferStorage(particle_colors_bo[i], sizeof(float) * 4 * max_particle_count, nullptr, 0);
+        }
+    }
+}
+
+void Application::prepare_particle_vaos() {
+    // The live particles are drawn as indices into the particle buffers, the alive list is the index buffer. The
+    // particles reach the vertex shader as attributes, so it needs no shader storage blocks.
+    for (int i = 0; i < 2; i++) {
+        glVertexArrayElementBuffer(particle_vao[i], particle_alive_bo[i]);
+        if (packed_particles) {
+            // The packed particle at location '2'.
+            glVertexArrayVertexBuffer(particle_vao[i], 0, particle_positions_bo[i], 0, 4 * sizeof(GLuint));
+            glEnableVertexArrayAttrib(particle_vao[i], 2);
+            glVertexArrayAttribIFormat(particle_vao[i], 2, 4, GL_UNSIGNED_INT, 0);
+            glVertexArrayAttribBinding(particle_vao[i], 2, 0);
+            glDisableVertexArrayAttrib(particle_vao[i], 0);
+            glDisableVertexArrayAttrib(particle_vao[i], 1);
+        } else {
+            // The positions at location '0' and the colors at '1'.
+            glVertexArrayVertexBuffer(particle_vao[i], 0, particle_positions_bo[i], 0, 4 * sizeof(float));
+            glEnableVertexArrayAttrib(particle_vao[i], 0);
+            glVertexArrayAttribFormat(particle_vao[i], 0, 4, GL_FLOAT, GL_FALSE, 0);
+            glVertexArrayAttribBinding(particle_vao[i], 0, 0);
+
+            glVertexArrayVertexBuffer(particle_vao[i], 1, particle_colors_bo[i], 0, 4 * sizeof(float));
+            glEnableVertexArrayAttrib(particle_vao[i], 1);
+            glVertexArrayAttribFormat(particle_vao[i], 1, 4, GL_FLOAT, GL_FALSE, 0);
+            glVertexArrayAttribBinding(particle_vao[i], 1, 1);
+            glDisableVertexArrayAttrib(particle_vao[i], 2);
+        }
+    }
+}
+
 void Application::reset_particles() {
     // Reset timer.
     elapsed_time = 0;
 
-    // Creates CPU buffers with the data of particles - positions and velocities.
-    std::vector<glm::vec4> particle_positions (max_particle_count, glm::vec4(0.0f));
-    std::vector<glm::vec4> particle_velocities (max_particle_count, glm::vec4(0.0f));
-    std::vector<glm::vec4> particle_colors (max_particle_count, glm::vec4(1.0f));
+    // Clears the particles on GPU. All particles start dead (zero alpha), they are emitted when their rocket launches.
+    // The clears must wait for the simulation writes to the buffers.
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    for (int i = 0; i < 2; i++) {
+        glClearNamedBufferData(particle_positions_bo[i], GL_RGBA32F, GL_RGBA, GL_FLOAT, nullptr);
+        if (!packed_particles) {
+            glClearNamedBufferData(particle_velocities_bo[i], GL_RGBA32F, GL_RGBA, GL_FLOAT, nullptr);
+            glClearNamedBufferData(particle_colors_bo[i], GL_RGBA32F, GL_RGBA, GL_FLOAT, nullptr);
+        }
+        glClearNamedBufferSubData(particle_alive_bo[i], GL_R32UI, 0, sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    }
+}
 
-    glNamedBufferSubData(particle_positions_bo, 0, sizeof(glm::vec4) * current_particle_count, particle_positions.data());
-    glNamedBufferSubData(particle_velocities_bo, 0, sizeof(glm::vec4) * current_particle_count, particle_velocities.data());
-    glNamedBufferSubData(particle_colors_bo, 0, sizeof(glm::vec4) * current_particle_count, particle_colors.data());
+void Application::prepare_rockets() {
+    // The particles are split evenly, the first 'larger_rockets' rockets get one particle more.
+    int fireworks_count = std::min(current_fireworks_count, current_particle_count);
+    int particles_per_rocket = current_particle_count / fireworks_count;
+    int larger_rockets = current_particle_count % fireworks_count;
+
+    // The first rocket launches from the center, the others from random places around the castle. The launch
+    // phases are evenly staggered over the life span. The generator has a fixed seed, so benchmarks are repeatable.
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> angle(0.0f, glm::radians(360.0f));
+    std::uniform_real_distribution<float> radius(3.0f, 6.0f);
+    std::vector<Rocket> rockets(fireworks_count);
+    for (int i = 0; i < fireworks_count; i++) {
+        glm::vec3 position(0.0f);
+        if (i > 0) {
+            float a = angle(generator);
+            float r = radius(generator);
+            position = glm::vec3(r * cosf(a), 0.0f, r * sinf(a));
+        }
+        rockets[i].launch = glm::vec4(position, float(i) / fireworks_count);
+        rockets[i].range = glm::uvec4(i * particles_per_rocket + std::min(i, larger_rockets), particles_per_rocket + (i < larger_rockets ? 1 : 0), 0, 0);
+    }
+    glNamedBufferSubData(rockets_bo, 0, sizeof(Rocket) * rockets.size(), rockets.data());
+    frame_upload_bytes += sizeof(Rocket) * rockets.size();
+
+    // One point light per rocket, the positions and colors are written by fireworks_light.comp. The lights share
+    // the ambient and diffuse intensity of the original single firework light.
+    int light_count = std::min(fireworks_count, int(MAX_FIREWORK_LIGHTS));
+    for (PhongLightsUBO& lights : phong_lights_bo) {
+        lights.clear();
+        for (int i = 0; i < light_count; i++) {
+            lights.add(PhongLightData::CreatePointLight(glm::vec3(rockets[i].launch), glm::vec3(0.1f / light_count), glm::vec3(0.0f), glm::vec3(0.0f)));
+        }
+        lights.update_opengl_data();
+    }
 }
 
 void Application::update_particles_gpu(float delta) {
@@ -234,14 +491,30 @@ void Application::update_particles_gpu(float delta) {
     float time_between_frames_in_milliseconds = delta;
     float time_between_frames_in_seconds = delta / 1000.f;
 
-    // Bind all buffers to OpenGL.
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particle_positions_bo);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, particle_velocities_bo);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, particle_colors_bo);
-    phong_lights_bo.bind_buffer_base(3);
+    // Reads the latest state and writes the other copy, together with its light.
+    int source = latest_particles;
+    int target = 1 - latest_particles;
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particle_positions_bo[source]);
+    phong_lights_bo[target].bind_buffer_base(3);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, particle_positions_bo[target]);
+    if (!packed_particles) {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, particle_velocities_bo[source]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, particle_colors_bo[source]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, particle_velocities_bo[target]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, particle_colors_bo[target]);
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, particle_partials_bo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, rockets_bo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, particle_alive_bo[target]);
 
-    // Memory barrier, we need the data in the buffers to be ready
-    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    // Memory barrier, the previous step (written one frame ago) is read by this dispatch as SSBOs and by the rendering
+    // as lights, vertex attributes, indices and indirect draw arguments. It is issued here and not right after the
+    // dispatch, so that the dispatch can run while the previous frame renders. It also orders the clear below after
+    // the atomic writes of the step before, which appended to the same alive list.
+    glMemoryBarrier(PARTICLE_BARRIER_BITS | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    // Resets the alive counter, i.e., the count of the indirect draw, the simulation appends the live particles.
+    glClearNamedBufferSubData(particle_alive_bo[target], GL_R32UI, 0, sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
 
     update_particles_program.use();
 
@@ -261,21 +534,53 @@ void Application::update_particles_gpu(float delta) {
     update_particles_program.uniform("fade_delay", fade_delay);
     update_particles_program.uniform("fade_time", fade_time);
     update_particles_program.uniform("rocket_spread", rocket_spread);
+    int fireworks_count = std::min(current_fireworks_count, current_particle_count);
+    update_particles_program.uniform("particles_per_rocket", current_particle_count / fireworks_count);
+    update_particles_program.uniform("larger_rockets", current_particle_count % fireworks_count);
+
+    // Dispatches the compute shader, the last work group is only partially used.
+    glDispatchCompute((current_particle_count + particle_local_size - 1) / particle_local_size, 1, 1);
+    frame_draw_calls++;
 
-    // Dispatches the compute shader
-    const int local_size_x = 256;
-    glDispatchCompute(current_particle_count / local_size_x, 1, 1);
+    // Sums the new positions of each rocket with a light in chunks, then sums the chunks of each rocket in one work
+    // group and writes its light.
+    int light_count = std::min(fireworks_count, int(MAX_FIREWORK_LIGHTS));
+    int largest_rocket = current_particle_count / fireworks_count + (current_particle_count % fireworks_count != 0 ? 1 : 0);
+    int chunks_per_rocket = (largest_rocket + LIGHT_CHUNK_SIZE - 1) / LIGHT_CHUNK_SIZE;
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    light_partials_program.use();
+    light_partials_program.uniform("chunks_per_rocket", chunks_per_rocket);
+    glDispatchCompute(chunks_per_rocket, light_count, 1);
+    frame_draw_calls++;
 
-    // Waits for OpenGL - don't forget OpenGL is asynchronous.
-    glFinish();
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    finalize_light_program.use();
+    finalize_light_program.uniform("chunks_per_rocket", chunks_per_rocket);
+    finalize_light_program.uniform("light_count", light_count);
+    glDispatchCompute(light_count, 1, 1);
+    frame_draw_calls++;
+    latest_particles = target;
+
+    if (legacy_sync) {
+        // Renders the step just computed, everything waits for the dispatch.
+        glMemoryBarrier(PARTICLE_BARRIER_BITS);
+        glFinish();
+        rendered_particles = target;
+    } else {
+        // Renders the previous step, which is one frame old, while the GPU computes this one.
+        rendered_particles = source;
+    }
 }
 
 // ----------------------------------------------------------------------------
 // Render
 // ----------------------------------------------------------------------------
 void Application::render() {
+    double render_start = glfwGetTime();
+
     // Begins measuring the GPU time.
-    glBeginQuery(GL_TIME_ELAPSED, render_time_query);
+    gpu_timer.begin(benchmark_recorder.frame_count());
 
     // Creates texture of reflection
     reflection_camera_ubo.bind_buffer_base(CameraUBO::DEFAULT_CAMERA_BINDING);
@@ -302,12 +607,25 @@ void Application::render() {
         show_texture(final_texture);
     }
 
-    // Evaluates the query.
-    glEndQuery(GL_TIME_ELAPSED);
-    glFinish();
-    GLuint64 render_time;
-    glGetQueryObjectui64v(render_time_query, GL_QUERY_RESULT, &render_time);
-    fps_gpu = 1000.f / (static_cast<float>(render_time) * 1e-6f);
+    // Stops measuring the GPU time, the shown time is of the latest frame the GPU already finished.
+    gpu_timer.end();
+    gpu_timer.collect();
+
+    if (benchmark_frames > 0) {
+        finish_benchmark_frame((glfwGetTime() - render_start) * 1000.0);
+    }
+    frame_draw_calls = 0;
+    frame_upload_bytes = 0;
+}
+
+void Application::finish_benchmark_frame(double cpu_ms) {
+    benchmark_recorder.add_frame(cpu_ms, frame_draw_calls, frame_upload_bytes);
+
+    if (int(benchmark_recorder.frame_count()) == benchmark_frames) {
+        gpu_timer.flush();
+        benchmark_recorder.write_report(benchmark_report, "firework_castle");
+        glfwSetWindowShouldClose(window, GLFW_TRUE);
+    }
 }
 
 void Application::combine_textures() {
@@ -327,6 +645,7 @@ void Application::combine_textures() {
 
     glBindVertexArray(empty_vao);
     glDrawArrays(GL_TRIANGLES, 0, 3);
+    frame_draw_calls++;
 
     glBindVertexArray(0);
     glUseProgram(0);
@@ -350,7 +669,7 @@ void Application::render_reflection() {
 
     const ShaderProgram& program = default_lit_program;
 
-    phong_lights_bo.bind_buffer_base(PhongLightsUBO::DEFAULT_LIGHTS_BINDING);
+    phong_lights_bo[rendered_particles].bind_buffer_base(PhongLightsUBO::DEFAULT_LIGHTS_BINDING);
 
     render_object(castle_object, program);
     render_object(castel_base, program);
@@ -388,7 +707,7 @@ void Application::evaluate_lighting_forward() {
     glEnable(GL_DEPTH_TEST);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    phong_lights_bo.bind_buffer_base(PhongLightsUBO::DEFAULT_LIGHTS_BINDING);
+    phong_lights_bo[rendered_particles].bind_buffer_base(PhongLightsUBO::DEFAULT_LIGHTS_BINDING);
 
     render_scene(default_lit_program);
 }
@@ -410,6 +729,7 @@ void Application::render_object(const SceneObject& object, const ShaderProgram&
     object.get_material().bind_buffer_base(PhongMaterialUBO::DEFAULT_MATERIAL_BINDING);
     object.get_geometry().bind_vao();
     object.get_geometry().draw();
+    frame_draw_calls++;
 }
 
 void Application::render_particles(bool black) {
@@ -432,12 +752,14 @@ void Application::render_particles(bool black) {
 
     glBindTextureUnit(0, particle_tex);
 
-    // Binds the proper VAO (we use the VAO with the data we just wrote).
-    glBindVertexArray(particle_vao);
-    // Memory barrier, we need the data in the buffers to be ready.
-    glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
-    // Draws the particles as points.
-    glDrawArrays(GL_POINTS, 0, current_particle_count);
+    // Binds the particle buffers, the barrier for their data is issued in update_particles_gpu.
+    particle_textured_program.uniform("packed_particles", packed_particles);
+    glBindVertexArray(particle_vao[rendered_particles]);
+    // Draws the live particles as points, their count and indices were written by the simulation.
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, particle_alive_bo[rendered_particles]);
+    glDrawElementsIndirect(GL_POINTS, GL_UNSIGNED_INT, nullptr);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    frame_draw_calls++;
 
     // Disables blending.
     glEnable(GL_DEPTH_TEST);
@@ -458,6 +780,7 @@ void Application::show_texture(GLuint texture) {
 
     glBindVertexArray(empty_vao);
     glDrawArrays(GL_TRIANGLES, 0, 3);
+    frame_draw_calls++;
 }
 
 // ----------------------------------------------------------------------------
@@ -481,11 +804,23 @@ void Application::render_ui() {
     if (ImGui::Button("Reset Particles")) {
         reset_particles();
     }
+    ImGui::Checkbox("Legacy Sync (glFinish)", &legacy_sync);
+
+    ImGui::SliderInt("Particle Count", &desired_particle_count, 1, max_particle_count);
+    ImGui::SliderInt("Fireworks Count", &desired_fireworks_count, 1, MAX_FIREWORKS);
 
-    const char* particle_labels[10] = {"256", "512", "1024", "2048", "4096", "8192", "16384", "32768", "65536", "131072"};
-    int exponent = static_cast<int>(log2(current_particle_count) - 8); // -8 because we start at 256 = 2^8
-    if (ImGui::Combo("Particle Count", &exponent, particle_labels, IM_ARRAYSIZE(particle_labels))) {
-        desired_particle_count = static_cast<int>(glm::pow(2, exponent + 8)); // +8 because we start at 256 = 2^8
+    const char* local_size_labels[4] = {"64", "128", "256", "512"};
+    int local_size_exponent = static_cast<int>(log2(particle_local_size) - 6); // -6 because we start at 64 = 2^6
+    if (ImGui::Combo("Work Group Size", &local_size_exponent, local_size_labels, IM_ARRAYSIZE(local_size_labels))) {
+        particle_local_size = 64 << local_size_exponent;
+        compile_particle_programs();
+    }
+    // The buffers hold the other layout, so the particles start over.
+    if (ImGui::Checkbox("Packed Particles", &packed_particles)) {
+        compile_particle_programs();
+        prepare_particle_buffers();
+        prepare_particle_vaos();
+        reset_particles();
     }
 
     ImGui::Combo("Display", &what_to_display, DISPLAY_LABELS, IM_ARRAYSIZE(DISPLAY_LABELS));
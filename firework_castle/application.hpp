@@ -1,8 +1,38 @@
 #pragma once
+#include "../common/benchmark.hpp"
 #include "camera_ubo.hpp"
 #include "light_ubo.hpp"
 #include "pv227_application.hpp"
 #include "scene_object.hpp"
+#include <map>
+
+/** One entry of the rocket table, the layout matches the Rocket struct in fireworks.comp (std430). */
+struct Rocket {
+    glm::vec4 launch; // xyz = launch position, w = launch phase in [0, 1) of the life span
+    glm::uvec4 range; // x = first particle, y = particle count
+};
+
+/**
+ * A compute program compiled with defines inserted after its #version line (e.g., "LOCAL_SIZE_X 256"). The locations
+ * of its uniforms are looked up once after each compilation, not every time a uniform is set.
+ */
+class ComputeProgram {
+  public:
+    /** Compiles the shader, the previous program is kept when the shader fails to compile or link. Returns false then. */
+    bool compile(const std::filesystem::path& filename, const std::vector<std::string>& defines);
+    void destroy();
+
+    void use() const;
+    void uniform(const char* name, float value) const;
+    void uniform(const char* name, int value) const;
+
+  private:
+    /** The location of the uniform, -1 (ignored by glProgramUniform) when the shader does not use it. */
+    GLint location(const char* name) const;
+
+    GLuint program = 0;
+    std::map<std::string, GLint, std::less<>> locations;
+};
 
 class Application : public PV227Application {
     // ----------------------------------------------------------------------------
@@ -26,16 +56,49 @@ class Application : public PV227Application {
     int current_particle_count;
     /** The maximum number of particles for which the memory is allocated. */
     int max_particle_count = 131072;
-    /** The positions of all particles. */
-    GLuint particle_positions_bo;
-    /** The velocities of all particles. */
-    GLuint particle_velocities_bo;
-    /** The colors of all particles. */
-    GLuint particle_colors_bo;
-    /** VAOs for rendering particles, one for each buffer with positions. */
-    GLuint particle_vao;
-    /** The UBO storing the data about lights - positions, colors, etc. */
-    PhongLightsUBO phong_lights_bo;
+    /**
+     * The positions of all particles, or the whole packed particles with packed_particles. There are two copies of
+     * the particle buffers, the simulation reads one and writes the other.
+     */
+    GLuint particle_positions_bo[2];
+    /** The velocities of all particles, only allocated for the unpacked layout. */
+    GLuint particle_velocities_bo[2] = {};
+    /** The colors of all particles, only allocated for the unpacked layout. */
+    GLuint particle_colors_bo[2] = {};
+    /**
+     * The live particles of each copy of the particle buffers, written by the simulation. The buffer starts with
+     * the arguments of glDrawElementsIndirect (the count is the atomic alive counter) padded to 8 indices, followed by
+     * the indices of the live particles. It is also the index buffer of the draw.
+     */
+    GLuint particle_alive_bo[2];
+    /** The barrier before the particles written by the simulation are read by the next step and by the draw. */
+    static const GLbitfield PARTICLE_BARRIER_BITS =
+        GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_ELEMENT_ARRAY_BARRIER_BIT | GL_COMMAND_BARRIER_BIT;
+    /** The VAOs for rendering each copy of the particle buffers, the particles are vertex attributes indexed by the alive list. */
+    GLuint particle_vao[2];
+    /** The copy of the particle buffers with the latest simulated state. */
+    int latest_particles = 0;
+    /** The copy of the particle buffers rendered in this frame. */
+    int rendered_particles = 0;
+    /** The UBO storing the data about lights - positions, colors, etc. One for each copy of the particle buffers, as the simulation writes the light. */
+    PhongLightsUBO phong_lights_bo[2];
+    /** The number of particles summed by one work group of light_partials_program. */
+    static const int LIGHT_CHUNK_SIZE = 1024;
+    /** The sums of the particle positions of each chunk of the rockets with lights, reduced into the rocket lights. */
+    GLuint particle_partials_bo;
+    /** The maximum number of rockets, the size of the rocket table. */
+    static const int MAX_FIREWORKS = 256;
+    /** The maximum number of rocket lights, i.e., the capacity of phong_lights_bo. Further rockets have no light. */
+    static const int MAX_FIREWORK_LIGHTS = 100;
+    /** The current number of rockets in simulation. */
+    int current_fireworks_count = 0;
+    /** The rocket table - launch positions, launch phases and particle ranges of all rockets. */
+    GLuint rockets_bo;
+    /**
+     * The flag determining if the simulated frame is waited for with glFinish and rendered right away (the old behavior).
+     * Otherwise the previous simulation step is rendered while the GPU computes the next one.
+     */
+    bool legacy_sync = false;
 
     // ----------------------------------------------------------------------------
     // Variables (Textures)
@@ -64,8 +127,12 @@ class Application : public PV227Application {
   protected:
     /** The program for rendering particles as a textured quad (generated in compute shader). */
     ShaderProgram particle_textured_program;
-    /** The simple program for updating particles. */
-    ShaderProgram update_particles_program;
+    /** The simple program for updating particles, compiled for particle_local_size. */
+    ComputeProgram update_particles_program;
+    /** The program summing the particle positions of each chunk of the rockets with lights. */
+    ComputeProgram light_partials_program;
+    /** The program summing the partial sums of the rockets into the rocket lights. */
+    ComputeProgram finalize_light_program;
     /** The simple program for creating masks. */
     ShaderProgram program_for_mask;
     /** The program used for debugging textures. */
@@ -100,6 +167,16 @@ class Application : public PV227Application {
     time_t last_calc = 0;
     /** The number of particles to be used in simulation. */
     int desired_particle_count = 256;
+    /** The number of rockets to be used in simulation. */
+    int desired_fireworks_count = 8;
+    /** The work group size of the particle update (64, 128, 256 or 512), the shader is recompiled when it changes. */
+    int particle_local_size = 256;
+    /**
+     * The flag determining if the particles use the packed layout - one uvec4 in particle_positions_bo with the
+     * position quantized to 16 bits, the half precision velocity and the RGBA8 color (16 instead of 48 bytes per
+     * particle, see fireworks.comp). The shaders are recompiled and the buffers reallocated when it changes.
+     */
+    bool packed_particles = false;
     /** The factor that determines how perfect the mirror is. */
     float mirror_factor = 0.8f;
     /** The gravitational acceleration. */
@@ -129,6 +206,23 @@ class Application : public PV227Application {
     /** The spread of the initial directions. */
     float rocket_spread;
 
+    // ----------------------------------------------------------------------------
+    // Variables (Benchmark)
+    // ----------------------------------------------------------------------------
+  protected:
+    /** The number of frames of the --benchmark=<frames> run, 0 when running interactively. */
+    int benchmark_frames = 0;
+    /** The report path without extension, set by --benchmark-report=<path>. */
+    std::filesystem::path benchmark_report = "firework_castle_benchmark";
+    /** The GPU time of render(), also shown as fps_gpu. */
+    GpuTimer gpu_timer;
+    /** The measurements of the finished benchmark frames. */
+    BenchmarkRecorder benchmark_recorder;
+    /** The draw and dispatch calls issued in the current frame. */
+    uint32_t frame_draw_calls = 0;
+    /** The bytes written into buffers in the current frame (framework UBO updates are not included). */
+    uint64_t frame_upload_bytes = 0;
+
     // ----------------------------------------------------------------------------
     // Constructors
     // ----------------------------------------------------------------------------
@@ -146,6 +240,9 @@ class Application : public PV227Application {
      */
     void compile_shaders() override;
 
+    /** Compiles the compute programs of the particle simulation for the current work group size. */
+    void compile_particle_programs();
+
     // ----------------------------------------------------------------------------
     // Initialize Scene
     // ----------------------------------------------------------------------------
@@ -165,6 +262,15 @@ class Application : public PV227Application {
     /** Prepares the scene objects. */
     void prepare_scene();
 
+    /** Loads the .obj file, a binary cache of it is kept in the cache directory to skip parsing on later starts. */
+    Geometry load_geometry(const std::filesystem::path& filename);
+
+    /** Allocates the velocity and color buffers when the particles use the unpacked layout, deletes them otherwise. */
+    void prepare_particle_buffers();
+
+    /** Sets the vertex attributes of the particle VAOs for the current particle layout. */
+    void prepare_particle_vaos();
+
     /** Prepares the frame buffer objects. */
     void prepare_framebuffers();
 
@@ -182,6 +288,9 @@ class Application : public PV227Application {
     /** Resets the positions and velocities of all particles in the simulation. */
     void reset_particles();
 
+    /** Fills the rocket table and the rocket lights for the current number of particles and rockets. */
+    void prepare_rockets();
+
     /** Updates the positions and velocities of all particles on GPU. */
     void update_particles_gpu(float delta);
 
@@ -198,6 +307,9 @@ class Application : public PV227Application {
     /** Renders the specified object. */
     void render_object(const SceneObject& object, const ShaderProgram& program);
 
+    /** Records the frame of the benchmark run, writes the report and closes the window after the last frame. */
+    void finish_benchmark_frame(double cpu_ms);
+
     /** Renders image without reflection to framebuffer. */
     void render_final();
 
@@ -3,9 +3,15 @@
 // ----------------------------------------------------------------------------
 // Input Variables
 // ----------------------------------------------------------------------------
-// The particle position.
+// The particle position and color, used with the unpacked layout.
 layout (location = 0) in vec4 position;
 layout (location = 1) in vec4 color;
+// The packed particle (see fireworks.comp), used with packed_particles.
+layout (location = 2) in uvec4 state;
+
+// The box the packed positions are quantized in (see fireworks.comp).
+const vec3 PARTICLE_BOX_MIN = vec3(-64.0, 0.0, -64.0);
+const float PARTICLE_BOX_SIZE = 128.0;
 
 // The UBO with camera data.	
 layout (std140, binding = 0) uniform CameraBuffer
@@ -18,6 +24,9 @@ layout (std140, binding = 0) uniform CameraBuffer
 	vec3 eye_position;		// The position of the eye in world space.
 };
 
+// The flag determining whether the particles use the packed layout.
+uniform bool packed_particles;
+
 // ----------------------------------------------------------------------------
 // Output Variables
 // ----------------------------------------------------------------------------
@@ -33,7 +42,14 @@ out VertexData
 // ----------------------------------------------------------------------------
 void main()
 {
-	out_data.position_vs = view * position;
-	out_data.color = color;
+	// Each vertex is one live particle, drawn by its index in the alive list.
+	if (packed_particles) {
+		vec3 box_position = vec3(unpackUnorm2x16(state.x), unpackUnorm2x16(state.y).x);
+		out_data.position_vs = view * vec4(PARTICLE_BOX_MIN + box_position * PARTICLE_BOX_SIZE, 1.0);
+		out_data.color = unpackUnorm4x8(state.w);
+	} else {
+		out_data.position_vs = view * position;
+		out_data.color = color;
+	}
 	out_data.id = gl_VertexID;
 }
\ No newline at end of file
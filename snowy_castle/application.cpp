@@ -1,19 +1,220 @@
 #include "application.hpp"
+#include "../common/arguments.hpp"
+#include "../common/mesh_cache.hpp"
+#include "../common/texture_cache.hpp"
 #include "utils.hpp"
+#include <algorithm>
 #include <map>
 
+// ----------------------------------------------------------------------------
+// Depth readback
+// ----------------------------------------------------------------------------
+void DepthReadback::create() {
+    // Starts at the far plane, the same as the depth buffer is cleared to.
+    float depth = 1.0f;
+    glCreateBuffers(FRAMES, buffers);
+    for (GLuint buffer : buffers) {
+        glNamedBufferStorage(buffer, sizeof(float), &depth, 0);
+    }
+}
+
+void DepthReadback::destroy() {
+    for (GLsync& fence : fences) {
+        if (fence != nullptr) {
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+    }
+    glDeleteBuffers(FRAMES, buffers);
+}
+
+void DepthReadback::request(glm::vec2 pixel, glm::vec2 viewport_size, const glm::mat4& clip_to_world) {
+    // glReadPixels writes nothing outside the window, such pixels keep the last position.
+    if (pixel.x < 0.0f || pixel.y < 0.0f || pixel.x >= viewport_size.x || pixel.y >= viewport_size.y) {
+        return;
+    }
+
+    // All buffers are in flight, the oldest read is dropped instead of waited for.
+    if (issued - read == FRAMES) {
+        glDeleteSync(fences[read % FRAMES]);
+        fences[read % FRAMES] = nullptr;
+        read++;
+    }
+
+    int slot = issued % FRAMES;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[slot]);
+    glReadPixels(static_cast<GLint>(pixel.x), static_cast<GLint>(pixel.y), 1, 1, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ndc_positions[slot] = pixel / viewport_size * 2.0f - 1.0f;
+    this->clip_to_world[slot] = clip_to_world;
+    issued++;
+}
+
+bool DepthReadback::collect() {
+    bool updated = false;
+    while (read < issued) {
+        int slot = read % FRAMES;
+        GLenum status = glClientWaitSync(fences[slot], 0, 0);
+        if (status == GL_TIMEOUT_EXPIRED) {
+            break;
+        }
+        glDeleteSync(fences[slot]);
+        fences[slot] = nullptr;
+        read++;
+        if (status == GL_WAIT_FAILED) {
+            continue;
+        }
+
+        float depth = 1.0f;
+        glGetNamedBufferSubData(buffers[slot], 0, sizeof(float), &depth);
+        glm::vec4 world_space = clip_to_world[slot] * glm::vec4(ndc_positions[slot], depth * 2.0f - 1.0f, 1.0f);
+        last_position = glm::vec3(world_space) / world_space.w;
+        updated = true;
+    }
+    return updated;
+}
+
+// ----------------------------------------------------------------------------
+// Tile mask readback
+// ----------------------------------------------------------------------------
+void TileMaskReadback::create(int words) {
+    this->words = words;
+    glCreateBuffers(FRAMES, buffers);
+    for (GLuint buffer : buffers) {
+        glNamedBufferStorage(buffer, words * sizeof(uint32_t), nullptr, 0);
+    }
+}
+
+void TileMaskReadback::destroy() {
+    for (GLsync& fence : fences) {
+        if (fence != nullptr) {
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+    }
+    glDeleteBuffers(FRAMES, buffers);
+    std::fill(std::begin(buffers), std::end(buffers), 0);
+    issued = 0;
+    read = 0;
+}
+
+void TileMaskReadback::request(GLuint mask_buffer) {
+    if (issued - read == FRAMES) {
+        return;
+    }
+
+    int slot = issued % FRAMES;
+    glCopyNamedBufferSubData(mask_buffer, buffers[slot], 0, 0, words * sizeof(uint32_t));
+    glClearNamedBufferData(mask_buffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    issued++;
+}
+
+bool TileMaskReadback::collect(std::vector<uint32_t>& mask) {
+    bool updated = false;
+    std::vector<uint32_t> words_read(words);
+    while (read < issued) {
+        int slot = read % FRAMES;
+        GLenum status = glClientWaitSync(fences[slot], 0, 0);
+        if (status == GL_TIMEOUT_EXPIRED) {
+            break;
+        }
+        glDeleteSync(fences[slot]);
+        fences[slot] = nullptr;
+        read++;
+        if (status == GL_WAIT_FAILED) {
+            continue;
+        }
+
+        glGetNamedBufferSubData(buffers[slot], 0, words * sizeof(uint32_t), words_read.data());
+        mask.resize(words, 0);
+        for (int i = 0; i < words; i++) {
+            mask[i] |= words_read[i];
+        }
+        updated = true;
+    }
+    return updated;
+}
+
+/** Rounds the positive value down to a power of two. */
+static int round_down_to_power_of_two(int value) {
+    int power = 1;
+    while (power <= value / 2) {
+        power *= 2;
+    }
+    return power;
+}
+
 Application::Application(int initial_width, int initial_height, std::vector<std::string> arguments)
     : PV227Application(initial_width, initial_height, arguments) {
+    for (const std::string& argument : arguments) {
+        parse_argument(argument, "--benchmark=", benchmark_frames);
+        if (argument.rfind("--benchmark-report=", 0) == 0) {
+            benchmark_report = argument.substr(19);
+        }
+        if (argument == "--fragment-snow") {
+            compute_snow = false;
+        }
+        if (argument == "--fixed-tessellation") {
+            adaptive_tessellation = false;
+        }
+        if (argument == "--clipmap-snow") {
+            clipmap_snow = true;
+        }
+        if (parse_argument(argument, "--snow-map-size=", snow_map_size)) {
+            snow_map_size = round_down_to_power_of_two(std::clamp(snow_map_size, MIN_SNOW_MAP_SIZE, MAX_SNOW_MAP_SIZE));
+        }
+    }
+    if (benchmark_frames > 0) {
+        // The snowflakes are placed with rand(), a fixed seed makes the runs comparable
+        srand(1);
+    }
+
+    // The GPU time is shown as fps_gpu and written into the benchmark sample of the frame it was measured in
+    gpu_timer.create([this](uint64_t frame, double ms) {
+        fps_gpu = static_cast<float>(1000.0 / ms);
+        if (benchmark_frames > 0) {
+            benchmark_recorder.set_gpu_time(frame, ms);
+        }
+    });
+    snow_timer.create([this](uint64_t, double ms) {
+        snow_time_sum += ms;
+        snow_time_count++;
+    });
+    tessellation_timer.create([this](uint64_t, double ms) {
+        tessellation_time_sum += ms;
+        tessellation_time_count++;
+    });
+    broom_readback.create();
     Application::compile_shaders();
     prepare_cameras();
     prepare_materials();
     prepare_textures();
     prepare_lights();
     prepare_scene();
+    prepare_snow();
+    prepare_clipmap();
     prepare_framebuffers();
 }
 
-Application::~Application() {}
+Application::~Application() {
+    gpu_timer.destroy();
+    snow_timer.destroy();
+    tessellation_timer.destroy();
+    broom_readback.destroy();
+    snow_changed_tiles_readback.destroy();
+    glDeleteBuffers(1, &snow_dirty_tiles_bo);
+    glDeleteBuffers(1, &snow_changed_tiles_bo);
+    glDeleteTextures(1, &snow_deposits_tex);
+    glDeleteBuffers(1, &snow_positions_bo);
+    glDeleteBuffers(1, &snow_velocities_bo);
+    glDeleteVertexArrays(1, &snow_vao);
+    glDeleteBuffers(1, &clipmap_vertices_bo);
+    glDeleteBuffers(1, &clipmap_indices_bo);
+    glDeleteBuffers(1, &clipmap_blocks_bo);
+    glDeleteVertexArrays(1, &clipmap_vao);
+}
 
 // ----------------------------------------------------------------------------
 // Shaderes
@@ -31,6 +232,10 @@ void Application::compile_shaders() {
     snowflakes_program.add_fragment_shader(lecture_shaders_path / "particles/snow.frag");
     snowflakes_program.link();
 
+    snowflakes_update_program = ShaderProgram();
+    snowflakes_update_program.add_compute_shader(lecture_shaders_path / "particles/snow.comp");
+    snowflakes_update_program.link();
+
     snow_program = ShaderProgram();
     snow_program.add_vertex_shader(lecture_shaders_path / "object.vert");
     snow_program.add_tess_control_shader(lecture_shaders_path / "teselation/snow.tesc");
@@ -38,8 +243,14 @@ void Application::compile_shaders() {
     snow_program.add_fragment_shader(lecture_shaders_path / "teselation/snow.frag");
     snow_program.link();
 
+    snow_clipmap_program = ShaderProgram(lecture_shaders_path / "clipmap/snow.vert", lecture_shaders_path / "teselation/snow.frag");
+
     blur_program = ShaderProgram(lecture_shaders_path / "full_screen_quad.vert", lecture_shaders_path / "blur.frag");
 
+    accumulate_snow_compute_program = ShaderProgram();
+    accumulate_snow_compute_program.add_compute_shader(lecture_shaders_path / "accumulate_snow.comp");
+    accumulate_snow_compute_program.link();
+
     std::cout << "Shaders are reloaded." << std::endl;
 }
 
@@ -78,28 +289,58 @@ void Application::prepare_materials() {
 }
 
 void Application::prepare_textures() {
-    broom_tex = TextureUtils::load_texture_2d(lecture_textures_path / "wood.jpg");
+    // Colors are stored as BC7, the normal map as BC5 (z is reconstructed in snow.frag) and the single channel maps as BC4
+    broom_tex = load_texture(lecture_textures_path / "wood.jpg", GL_COMPRESSED_RGBA_BPTC_UNORM);
     TextureUtils::set_texture_2d_parameters(broom_tex, GL_REPEAT, GL_REPEAT, GL_LINEAR, GL_LINEAR);
 
-    ice_albedo_tex = TextureUtils::load_texture_2d(lecture_textures_path / "ice_albedo.png");
+    ice_albedo_tex = load_texture(lecture_textures_path / "ice_albedo.png", GL_COMPRESSED_RGBA_BPTC_UNORM);
     TextureUtils::set_texture_2d_parameters(ice_albedo_tex, GL_REPEAT, GL_REPEAT, GL_LINEAR, GL_LINEAR);
 
-    snow_albedo_tex = TextureUtils::load_texture_2d(lecture_textures_path / "snow_albedo.png");
+    snow_albedo_tex = load_texture(lecture_textures_path / "snow_albedo.png", GL_COMPRESSED_RGBA_BPTC_UNORM);
     TextureUtils::set_texture_2d_parameters(snow_albedo_tex, GL_REPEAT, GL_REPEAT, GL_LINEAR, GL_LINEAR);
 
-    snow_normal_tex = TextureUtils::load_texture_2d(lecture_textures_path / "snow_normal.png");
+    snow_normal_tex = load_texture(lecture_textures_path / "snow_normal.png", GL_COMPRESSED_RG_RGTC2);
     TextureUtils::set_texture_2d_parameters(snow_normal_tex, GL_REPEAT, GL_REPEAT, GL_LINEAR, GL_LINEAR);
 
-    snow_height_tex = TextureUtils::load_texture_2d(lecture_textures_path / "snow_height.png");
+    snow_height_tex = load_texture(lecture_textures_path / "snow_height.png", GL_COMPRESSED_RED_RGTC1);
     TextureUtils::set_texture_2d_parameters(snow_height_tex, GL_REPEAT, GL_REPEAT, GL_LINEAR, GL_LINEAR);
 
-    snow_roughness_tex = TextureUtils::load_texture_2d(lecture_textures_path / "snow_roughness.png");
+    snow_roughness_tex = load_texture(lecture_textures_path / "snow_roughness.png", GL_COMPRESSED_RED_RGTC1);
     TextureUtils::set_texture_2d_parameters(snow_roughness_tex, GL_REPEAT, GL_REPEAT, GL_LINEAR, GL_LINEAR);
 
-    particle_tex = TextureUtils::load_texture_2d(lecture_textures_path / "star.png");
+    particle_tex = load_texture(lecture_textures_path / "star.png", GL_COMPRESSED_RGBA_BPTC_UNORM);
     TextureUtils::set_texture_2d_parameters(particle_tex, GL_REPEAT, GL_REPEAT, GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR);
 }
 
+GLuint Application::load_texture(const std::filesystem::path& filename, GLenum format) {
+    double start = glfwGetTime();
+    CompressedImage compressed;
+    if (read_texture_cache(filename, format, compressed)) {
+        std::cout << filename.filename().string() << " loaded from cache in " << (glfwGetTime() - start) * 1000.0 << " ms\n";
+        return upload_compressed_texture(compressed);
+    }
+
+    // The image is decoded by TextureUtils and read back, so the orientation stays the same as before
+    GLuint source = TextureUtils::load_texture_2d(filename);
+    ImageData image;
+    image.channels = 4;
+    glGetTextureLevelParameteriv(source, 0, GL_TEXTURE_WIDTH, &image.width);
+    glGetTextureLevelParameteriv(source, 0, GL_TEXTURE_HEIGHT, &image.height);
+    image.pixels.resize(size_t(image.width) * image.height * image.channels);
+    glGetTextureImage(source, 0, GL_RGBA, GL_UNSIGNED_BYTE, GLsizei(image.pixels.size()), image.pixels.data());
+
+    glDeleteTextures(1, &source);
+
+    std::vector<ImageData> mips = build_mip_chain(std::move(image));
+    compressed = compress_mip_chain(mips, format);
+    if (compressed.levels.empty()) {
+        return upload_mip_chain(mips);
+    }
+    write_texture_cache(filename, compressed);
+    std::cout << filename.filename().string() << " compressed in " << (glfwGetTime() - start) * 1000.0 << " ms\n";
+    return upload_compressed_texture(compressed);
+}
+
 void Application::prepare_lights() {
     // The rest is set in the update scene method.
     phong_lights_ubo.set_global_ambient(glm::vec3(0.0f));
@@ -127,45 +368,84 @@ void Application::resize_fullscreen_textures() {}
 
 void Application::initialize_fbo_textures() {
     // Removes the previously allocated textures (if any).
-    glDeleteTextures(1, &accumulated_snow_tex[0]);
-    glDeleteTextures(1, &accumulated_snow_tex[1]);
+    glDeleteTextures(2, accumulated_snow_tex);
+    glDeleteTextures(1, &snow_deposits_tex);
     glDeleteTextures(1, &ortho_tex);
     glDeleteTextures(1, &ortho_depth_tex);
+    accumulated_snow_tex[0] = accumulated_snow_tex[1] = 0;
+
+    // Creates the snow textures, the second one only when the fragment passes bounce between them.
+    create_snow_texture(0);
+    if (!compute_snow) {
+        create_snow_texture(1);
+    }
+
+    // Creates the deposits of the snowflakes, empty at the start.
+    glCreateTextures(GL_TEXTURE_2D, 1, &snow_deposits_tex);
+    glTextureStorage2D(snow_deposits_tex, 1, GL_R32UI, snow_map_size / SNOW_DEPOSIT_CELL_SIZE, snow_map_size / SNOW_DEPOSIT_CELL_SIZE);
+    glClearTexImage(snow_deposits_tex, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
 
     // Creates new textures for framebuffers and set their basic parameters.
-    glCreateTextures(GL_TEXTURE_2D, 1, &accumulated_snow_tex[0]);
-    glCreateTextures(GL_TEXTURE_2D, 1, &accumulated_snow_tex[1]);
     glCreateTextures(GL_TEXTURE_2D, 1, &ortho_tex);
     glCreateTextures(GL_TEXTURE_2D, 1, &ortho_depth_tex);
 
     // Initializes the immutable storage.
-    glTextureStorage2D(accumulated_snow_tex[0], 1, GL_R16F, 1024, 1024);
-    glTextureStorage2D(accumulated_snow_tex[1], 1, GL_R16F, 1024, 1024);
     glTextureStorage2D(ortho_tex, 1, GL_RGBA8, 1024, 1024);
     glTextureStorage2D(ortho_depth_tex, 1, GL_DEPTH_COMPONENT24, 1024, 1024);
 
 
     // Sets the texture parameters.
-    TextureUtils::set_texture_2d_parameters(accumulated_snow_tex[0], GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
-    TextureUtils::set_texture_2d_parameters(accumulated_snow_tex[1], GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
     TextureUtils::set_texture_2d_parameters(ortho_tex, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
     TextureUtils::set_texture_2d_parameters(ortho_depth_tex, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
 
     // Binds textures to framebuffers.
-    glNamedFramebufferTexture(accumulated_snow_fbo[0], GL_COLOR_ATTACHMENT0, accumulated_snow_tex[0], 0);
-    glNamedFramebufferTexture(accumulated_snow_fbo[1], GL_COLOR_ATTACHMENT0, accumulated_snow_tex[1], 0);
     glNamedFramebufferTexture(ortho_fbo, GL_COLOR_ATTACHMENT0, ortho_tex, 0);
     glNamedFramebufferTexture(ortho_fbo, GL_DEPTH_ATTACHMENT, ortho_depth_tex, 0);
 
     // Checks status of framebuffers.
-    FBOUtils::check_framebuffer_status(accumulated_snow_fbo[0], "Snow buffer #1");
-    FBOUtils::check_framebuffer_status(accumulated_snow_fbo[1], "Snow buffer #2");
     FBOUtils::check_framebuffer_status(ortho_fbo, "Ortho buffer");
+
+    // Prepares the dirty tile map and the change mask, the buffers are large enough for all tiles of the map.
+    snow_tiles_per_side = snow_map_size / SNOW_TILE_SIZE;
+    snow_tile_dirty_steps.assign(snow_tiles_per_side * snow_tiles_per_side, 0);
+    glDeleteBuffers(1, &snow_dirty_tiles_bo);
+    glCreateBuffers(1, &snow_dirty_tiles_bo);
+    glNamedBufferStorage(snow_dirty_tiles_bo, snow_tile_dirty_steps.size() * sizeof(uint32_t), nullptr, GL_DYNAMIC_STORAGE_BIT);
+
+    int mask_words = static_cast<int>((snow_tile_dirty_steps.size() + 31) / 32);
+    snow_changed_tiles.assign(mask_words, 0);
+    glDeleteBuffers(1, &snow_changed_tiles_bo);
+    glCreateBuffers(1, &snow_changed_tiles_bo);
+    glNamedBufferStorage(snow_changed_tiles_bo, mask_words * sizeof(uint32_t), snow_changed_tiles.data(), 0);
+    snow_changed_tiles_readback.destroy();
+    snow_changed_tiles_readback.create(mask_words);
+}
+
+void Application::create_snow_texture(int index) {
+    glCreateTextures(GL_TEXTURE_2D, 1, &accumulated_snow_tex[index]);
+    glTextureStorage2D(accumulated_snow_tex[index], 1, GL_R16F, snow_map_size, snow_map_size);
+    TextureUtils::set_texture_2d_parameters(accumulated_snow_tex[index], GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
+    glNamedFramebufferTexture(accumulated_snow_fbo[index], GL_COLOR_ATTACHMENT0, accumulated_snow_tex[index], 0);
+    FBOUtils::check_framebuffer_status(accumulated_snow_fbo[index], index == 0 ? "Snow buffer #1" : "Snow buffer #2");
+}
+
+Geometry Application::load_geometry(const std::filesystem::path& filename) {
+    double start = glfwGetTime();
+    MeshData mesh;
+    if (read_mesh_cache(filename, mesh)) {
+        std::cout << filename.filename().string() << " loaded from cache in " << (glfwGetTime() - start) * 1000.0 << " ms\n";
+        return Geometry(mesh.mode, mesh.positions, mesh.indices, mesh.normals, std::vector<float>(), mesh.tex_coords);
+    }
+
+    Geometry geometry = Geometry::from_file(filename);
+    std::cout << filename.filename().string() << " parsed in " << (glfwGetTime() - start) * 1000.0 << " ms\n";
+    write_mesh_cache(filename, {geometry.mode, geometry.positions, geometry.normals, geometry.tex_coords, geometry.indices});
+    return geometry;
 }
 
 void Application::prepare_scene() {
 
-    Geometry plane = Geometry::from_file(lecture_folder_path / "models/plane.obj");
+    Geometry plane = load_geometry(lecture_folder_path / "models/plane.obj");
     snow_terrain_object = SceneObject(
         plane, ModelUBO(scale(translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, 0.0f)) * glm::mat4(1.0f), glm::vec3(26.f, 1.f, 26.f))),
         snow_material_ubo, snow_albedo_tex);
@@ -182,14 +462,18 @@ void Application::prepare_scene() {
         cube, ModelUBO(translate(glm::mat4(1.0f), glm::vec3(0.0f, -0.05f, 0.0f)) * scale(glm::mat4(1.0f), glm::vec3(12.f, 0.1f, 12.f))),
         blue_material_ubo, ice_albedo_tex);
 
-    Geometry castle = Geometry::from_file(lecture_folder_path / "models/castle.obj");
+    Geometry castle = load_geometry(lecture_folder_path / "models/castle.obj");
     castle_object = SceneObject(
         castle, ModelUBO(scale(translate(glm::mat4(1.0f), glm::vec3(0.0f, 1.06f, 0.0f)) * glm::mat4(1.0f), glm::vec3(7.f, 7.f, 7.f))),
         castle_material_ubo);
 
     // Prepares the broom model - rest is set in the update method.
-    Geometry broom = Geometry::from_file(lecture_folder_path / "models/broom.obj");
+    Geometry broom = load_geometry(lecture_folder_path / "models/broom.obj");
     broom_object = SceneObject(broom, ModelUBO(), white_material_ubo, broom_tex);
+    for (size_t i = 0; i + 2 < broom.positions.size(); i += 3) {
+        broom_radius = std::max(broom_radius, glm::length(glm::vec2(broom.positions[i], broom.positions[i + 2])));
+    }
+    broom_radius *= 8.0f; // The broom is scaled in update_broom_location.
 
     // The light model is placed based on the value from UI so we update its model matrix later.
     // We are also not adding it to the scene_objects since we render it separately.
@@ -197,28 +481,90 @@ void Application::prepare_scene() {
 }
 
 void Application::prepare_snow() {
-    // Initialize snowflakes positions.
-    std::vector<glm::vec3> snow_initial_positions(current_snow_count);
-    for (int i = 0; i < current_snow_count; i++)
-        snow_initial_positions[i] = glm::vec3((static_cast<float>(rand()) / static_cast<float>(RAND_MAX) - 0.5f) * 26,
+    // Initialize snowflakes positions, w counts the landings of the snowflake and seeds its next spawn.
+    std::vector<glm::vec4> snow_initial_positions(MAX_SNOW_COUNT);
+    std::vector<glm::vec4> snow_initial_velocities(MAX_SNOW_COUNT, glm::vec4(0.0f, -3.0f, 0.0f, 0.0f));
+    for (int i = 0; i < MAX_SNOW_COUNT; i++)
+        snow_initial_positions[i] = glm::vec4((static_cast<float>(rand()) / static_cast<float>(RAND_MAX) - 0.5f) * 26,
                                               static_cast<float>(rand()) / static_cast<float>(RAND_MAX) * 50.0f,
-                                              (static_cast<float>(rand()) / static_cast<float>(RAND_MAX) - 0.5f) * 26);
+                                              (static_cast<float>(rand()) / static_cast<float>(RAND_MAX) - 0.5f) * 26, 0.0f);
 
     glCreateBuffers(1, &snow_positions_bo);
-    glNamedBufferStorage(snow_positions_bo, sizeof(float) * 3 * current_snow_count, snow_initial_positions.data(), 0);
+    glNamedBufferStorage(snow_positions_bo, sizeof(glm::vec4) * MAX_SNOW_COUNT, snow_initial_positions.data(), 0);
+    glCreateBuffers(1, &snow_velocities_bo);
+    glNamedBufferStorage(snow_velocities_bo, sizeof(glm::vec4) * MAX_SNOW_COUNT, snow_initial_velocities.data(), 0);
 
     glCreateVertexArrays(1, &snow_vao);
-    glVertexArrayVertexBuffer(snow_vao, Geometry_Base::DEFAULT_POSITION_LOC, snow_positions_bo, 0, 3 * sizeof(float));
+    glVertexArrayVertexBuffer(snow_vao, Geometry_Base::DEFAULT_POSITION_LOC, snow_positions_bo, 0, sizeof(glm::vec4));
 
     glEnableVertexArrayAttrib(snow_vao, Geometry_Base::DEFAULT_POSITION_LOC);
-    glVertexArrayAttribFormat(snow_vao, Geometry_Base::DEFAULT_POSITION_LOC, 3, GL_FLOAT, GL_FALSE, 0);
+    glVertexArrayAttribFormat(snow_vao, Geometry_Base::DEFAULT_POSITION_LOC, 4, GL_FLOAT, GL_FALSE, 0);
     glVertexArrayAttribBinding(snow_vao, Geometry_Base::DEFAULT_POSITION_LOC, Geometry_Base::DEFAULT_POSITION_LOC);
 }
 
+void Application::prepare_clipmap() {
+    // One block is a grid of CLIPMAP_BLOCK_SIZE x CLIPMAP_BLOCK_SIZE cells, counter-clockwise when seen from above.
+    std::vector<glm::vec2> vertices;
+    for (int z = 0; z <= CLIPMAP_BLOCK_SIZE; z++) {
+        for (int x = 0; x <= CLIPMAP_BLOCK_SIZE; x++) {
+            vertices.push_back(glm::vec2(x, z));
+        }
+    }
+    std::vector<uint32_t> indices;
+    for (int z = 0; z < CLIPMAP_BLOCK_SIZE; z++) {
+        for (int x = 0; x < CLIPMAP_BLOCK_SIZE; x++) {
+            uint32_t corner = z * (CLIPMAP_BLOCK_SIZE + 1) + x;
+            uint32_t next_row = corner + CLIPMAP_BLOCK_SIZE + 1;
+            indices.insert(indices.end(), {corner, next_row, corner + 1, corner + 1, next_row, next_row + 1});
+        }
+    }
+
+    // Every level is 4x4 blocks, the finer levels fill the 2x2 blocks in the center of the coarser ones.
+    for (int level = 0; level < CLIPMAP_LEVELS; level++) {
+        for (int by = -2; by < 2; by++) {
+            for (int bx = -2; bx < 2; bx++) {
+                bool center = (bx == -1 || bx == 0) && (by == -1 || by == 0);
+                if (level > 0 && center) continue;
+                clipmap_blocks.push_back(glm::ivec4(bx * CLIPMAP_BLOCK_SIZE, by * CLIPMAP_BLOCK_SIZE, level, 0));
+            }
+        }
+    }
+    clipmap_index_count = static_cast<GLsizei>(indices.size());
+
+    glCreateBuffers(1, &clipmap_vertices_bo);
+    glNamedBufferStorage(clipmap_vertices_bo, vertices.size() * sizeof(glm::vec2), vertices.data(), 0);
+    glCreateBuffers(1, &clipmap_indices_bo);
+    glNamedBufferStorage(clipmap_indices_bo, indices.size() * sizeof(uint32_t), indices.data(), 0);
+    glCreateBuffers(1, &clipmap_blocks_bo);
+    glNamedBufferStorage(clipmap_blocks_bo, clipmap_blocks.size() * sizeof(glm::ivec4), nullptr, GL_DYNAMIC_STORAGE_BIT);
+
+    // The grid position is a vertex attribute, the block is an instance attribute.
+    glCreateVertexArrays(1, &clipmap_vao);
+    glVertexArrayElementBuffer(clipmap_vao, clipmap_indices_bo);
+    glVertexArrayVertexBuffer(clipmap_vao, 0, clipmap_vertices_bo, 0, sizeof(glm::vec2));
+    glVertexArrayVertexBuffer(clipmap_vao, 1, clipmap_blocks_bo, 0, sizeof(glm::ivec4));
+    glVertexArrayBindingDivisor(clipmap_vao, 1, 1);
+
+    glEnableVertexArrayAttrib(clipmap_vao, 0);
+    glVertexArrayAttribFormat(clipmap_vao, 0, 2, GL_FLOAT, GL_FALSE, 0);
+    glVertexArrayAttribBinding(clipmap_vao, 0, 0);
+
+    glEnableVertexArrayAttrib(clipmap_vao, 3);
+    glVertexArrayAttribIFormat(clipmap_vao, 3, 4, GL_INT, 0);
+    glVertexArrayAttribBinding(clipmap_vao, 3, 1);
+}
+
 // ----------------------------------------------------------------------------
 // Update
 // ----------------------------------------------------------------------------
 void Application::update(float delta) {
+    // The benchmark runs with a fixed time step and orbits the camera once around the castle.
+    if (benchmark_frames > 0) {
+        delta = BENCHMARK_TIME_STEP_MS;
+        float progress = float(benchmark_recorder.frame_count()) / benchmark_frames;
+        camera.set_eye_position(glm::radians(-45.f + 360.f * progress), glm::radians(20.f + 15.f * sinf(glm::radians(360.f * progress))),
+                                50.f - 20.f * progress);
+    }
     PV227Application::update(delta);
 
     // Updates the main camera.
@@ -240,28 +586,51 @@ void Application::update(float delta) {
     phong_lights_ubo.add(PhongLightData::CreatePointLight(light_position, glm::vec3(0.1f), glm::vec3(0.9f), glm::vec3(1.0f)));
     phong_lights_ubo.update_opengl_data();
 
-    // Recreates particles if the number changed.
-    if (current_snow_count != desired_snow_count) {
-        current_snow_count = desired_snow_count;
-        prepare_snow();
-    }
+    // The buffers hold all snowflakes, only the first current_snow_count of them are simulated and rendered.
+    current_snow_count = desired_snow_count;
 
     snow_matrix = glm::translate(glm::mat4(1.0f), glm::vec3(0.5f)) * glm::scale(glm::mat4(1.0f), glm::vec3(0.5f)) 
                     * ortho_proj_matrix * ortho_view_matrix;
 
     render_ortho();
+    update_snowflakes(delta);
 }
 
-void Application::update_broom_location() {
-    // Updates the broom location.
-    float winZ = 0;
-    glReadPixels(broom_center.x, broom_center.y, 1, 1, GL_DEPTH_COMPONENT, GL_FLOAT, &winZ);
+void Application::update_snowflakes(float delta) {
+    snowflakes_update_program.use();
+    snowflakes_update_program.uniform_matrix("snow_matrix", snow_matrix);
+    snowflakes_update_program.uniform("snow_count", current_snow_count);
+    snowflakes_update_program.uniform("delta_s", delta * 1e-3f);
+    snowflakes_update_program.uniform("elapsed_time_s", static_cast<float>(elapsed_time) * 1e-3f);
+    snowflakes_update_program.uniform("wind_strength", wind_strength);
+    // The same amount of snow as the former spot of 0.001 at its center spread over 3x3 texels.
+    snowflakes_update_program.uniform("deposit", 0.004f / (SNOW_DEPOSIT_CELL_SIZE * SNOW_DEPOSIT_CELL_SIZE));
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, snow_positions_bo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, snow_velocities_bo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, snow_changed_tiles_bo);
+    glBindTextureUnit(1, ortho_depth_tex);
+    glBindImageTexture(0, snow_deposits_tex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
 
-    glm::vec4 clip_space =
-        glm::vec4((broom_center.x / width) * 2.0f - 1.0f, (broom_center.y / height) * 2.0f - 1.0f, winZ * 2.0 - 1.0, 1.0f);
-    glm::vec4 world_space = glm::inverse(camera.get_view_matrix()) * glm::inverse(projection_matrix) * clip_space;
-    glm::vec3 position = glm::vec3(world_space.x / world_space.w, world_space.y / world_space.w + 4.0f, world_space.z / world_space.w);
+    glDispatchCompute((current_snow_count + 255) / 256, 1, 1);
+    frame_draw_calls++;
 
+    // The positions are then drawn, the deposits taken by the accumulation and the changed tiles read back.
+    glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT |
+                    GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    glUseProgram(0);
+}
+
+void Application::update_broom_location() {
+    // Uses the latest depth the GPU already delivered and requests the depth of this frame, neither waits for the GPU.
+    bool updated = broom_readback.collect();
+    broom_readback.request(broom_center, glm::vec2(width, height), glm::inverse(camera.get_view_matrix()) * glm::inverse(projection_matrix));
+    if (!updated) {
+        return;
+    }
+
+    // Updates the broom location.
+    glm::vec3 position = broom_readback.last_position + glm::vec3(0.0f, 4.0f, 0.0f);
     broom_object.get_model_ubo().set_matrix(glm::translate(glm::mat4(1.0f), position) * glm::scale(glm::mat4(1.0f), glm::vec3(8.f)));
     broom_object.get_model_ubo().update_opengl_data();
 }
@@ -270,8 +639,10 @@ void Application::update_broom_location() {
 // Render
 // ----------------------------------------------------------------------------
 void Application::render() {
+    double render_start = glfwGetTime();
+
     // Starts measuring the elapsed time.
-    glBeginQuery(GL_TIME_ELAPSED, render_time_query);
+    gpu_timer.begin(benchmark_recorder.frame_count());
 
     // Binds the lights for everything.
     phong_lights_ubo.bind_buffer_base(PhongLightsUBO::DEFAULT_LIGHTS_BINDING);
@@ -287,22 +658,41 @@ void Application::render() {
         show_texture(accumulated_snow_tex[0]);
     }
     else if (what_to_display == DISPLAY_SNOW_2) {
-        show_texture(accumulated_snow_tex[1]);
+        show_texture(accumulated_snow_tex[compute_snow ? 0 : 1]);
     }
     else if (what_to_display == DISPLAY_ORTHO) {
         show_texture(ortho_tex);
     }
 
-    // Stops measuring the elapsed time.
-    glEndQuery(GL_TIME_ELAPSED);
+    // Stops measuring the elapsed time, the shown time is of the latest frame the GPU already finished.
+    gpu_timer.end();
+    gpu_timer.collect();
 
-    // Waits for OpenGL - don't forget OpenGL is asynchronous.
-    glFinish();
+    if (benchmark_frames > 0) {
+        finish_benchmark_frame((glfwGetTime() - render_start) * 1000.0);
+    }
+    frame_draw_calls = 0;
+    frame_upload_bytes = 0;
+}
 
-    // Evaluates the query.
-    GLuint64 render_time;
-    glGetQueryObjectui64v(render_time_query, GL_QUERY_RESULT, &render_time);
-    fps_gpu = 1000.f / (static_cast<float>(render_time) * 1e-6f);
+void Application::finish_benchmark_frame(double cpu_ms) {
+    benchmark_recorder.add_frame(cpu_ms, frame_draw_calls, frame_upload_bytes);
+
+    if (int(benchmark_recorder.frame_count()) == benchmark_frames) {
+        gpu_timer.flush();
+        snow_timer.flush();
+        tessellation_timer.flush();
+        benchmark_recorder.write_report(benchmark_report, "snowy_castle");
+        if (snow_time_count > 0) {
+            std::cout << "Snow accumulation (" << (compute_snow ? "compute" : "fragment") << "): " << snow_time_sum / snow_time_count
+                      << " ms per step, " << snow_time_count << " steps\n";
+        }
+        if (tessellation_time_count > 0) {
+            std::cout << "Snow surface (" << (clipmap_snow ? "clipmap" : adaptive_tessellation ? "adaptive" : "fixed 128") << "): "
+                      << tessellation_time_sum / tessellation_time_count << " ms per frame, " << tessellation_time_count << " frames\n";
+        }
+        glfwSetWindowShouldClose(window, GLFW_TRUE);
+    }
 }
 
 void Application::render_final() {
@@ -322,14 +712,23 @@ void Application::render_final() {
     glBindTextureUnit(2, accumulated_snow_tex[0]);
     default_lit_program.uniform_matrix("snow_matrix", snow_matrix);
     default_lit_program.uniform("use_snow", show_snow);
+    default_lit_program.uniform("snow_level", snow_level);
 
     render_object(outer_terrain_object, default_lit_program, false);
     render_object(castel_base, default_lit_program, false);
     render_object(lake_object, default_lit_program, false, 10);
     render_object(castle_object, default_lit_program, false);
+    frame_draw_calls += 4;
 
     if (show_tessellated_snow) {
-        render_tese_snow();
+        tessellation_timer.collect();
+        tessellation_timer.begin(benchmark_recorder.frame_count());
+        if (clipmap_snow) {
+            render_clipmap_snow();
+        } else {
+            render_tese_snow();
+        }
+        tessellation_timer.end();
     }
 
     update_broom_location();
@@ -337,6 +736,7 @@ void Application::render_final() {
     default_lit_program.uniform("use_snow", false);
     render_object(broom_object, default_lit_program, false);
     render_object(light_object, default_unlit_program, false);
+    frame_draw_calls += 2;
 
     render_snow();
 
@@ -359,6 +759,7 @@ void Application::render_ortho() {
     render_object(lake_object, default_unlit_program, false, 10);
     render_object(castel_base, default_unlit_program, false);
     render_object(castle_object, default_unlit_program, false);
+    frame_draw_calls += 4;
 
     // Resets the VAO and the program.
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -379,6 +780,7 @@ void Application::show_texture(GLuint texture) {
 
     glBindVertexArray(empty_vao);
     glDrawArrays(GL_TRIANGLES, 0, 3);
+    frame_draw_calls++;
 
     // Resets the VAO and the program.
     glBindVertexArray(0);
@@ -390,10 +792,10 @@ void Application::render_snow() {
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glDepthMask(GL_FALSE);
     snowflakes_program.use();
-    snowflakes_program.uniform("elapsed_time_s", static_cast<float>(elapsed_time) * 1e-3f);
     glBindTextureUnit(0, particle_tex);
     glBindVertexArray(snow_vao);
     glDrawArrays(GL_POINTS, 0, current_snow_count);
+    frame_draw_calls++;
     glDisable(GL_BLEND);
     glDepthMask(GL_TRUE);
 }
@@ -401,13 +803,73 @@ void Application::render_snow() {
 void Application::render_tese_snow() {
     snow_program.use();
     snow_program.uniform_matrix("snow_matrix", snow_matrix);
+    snow_program.uniform("snow_level", snow_level);
+    snow_program.uniform("adaptive", adaptive_tessellation);
+    snow_program.uniform("viewport_size", glm::vec2(width, height));
 
     glBindTextureUnit(1, ortho_depth_tex);
-    glBindTextureUnit(2, accumulated_snow_tex[1]);
+    glBindTextureUnit(2, accumulated_snow_tex[compute_snow ? 0 : 1]);
     glBindTextureUnit(3, snow_height_tex);
     glBindTextureUnit(4, snow_normal_tex);
 
     render_object(snow_terrain_object, snow_program, true);
+    frame_draw_calls++;
+}
+
+void Application::render_clipmap_snow() {
+    // All levels share one center snapped to the cells of the coarsest level, so the vertices of neighbouring levels line up.
+    float coarsest_cell_size = CLIPMAP_CELL_SIZE * static_cast<float>(1 << (CLIPMAP_LEVELS - 1));
+    glm::vec3 eye_position = glm::clamp(camera.get_eye_position(), glm::vec3(-13.0f), glm::vec3(13.0f));
+    glm::vec2 center = glm::round(glm::vec2(eye_position.x, eye_position.z) / coarsest_cell_size) * coarsest_cell_size;
+    update_clipmap_blocks(center);
+
+    snow_clipmap_program.use();
+    snow_clipmap_program.uniform_matrix("snow_matrix", snow_matrix);
+    snow_clipmap_program.uniform("snow_level", snow_level);
+    snow_clipmap_program.uniform("clipmap_center", center);
+    snow_clipmap_program.uniform("clipmap_cell_size", CLIPMAP_CELL_SIZE);
+    snow_clipmap_program.uniform("clipmap_levels", CLIPMAP_LEVELS);
+    snow_clipmap_program.uniform("block_size", CLIPMAP_BLOCK_SIZE);
+    snow_clipmap_program.uniform("has_texture", snow_terrain_object.has_texture());
+
+    glBindTextureUnit(0, snow_terrain_object.get_texture());
+    glBindTextureUnit(1, ortho_depth_tex);
+    glBindTextureUnit(2, accumulated_snow_tex[compute_snow ? 0 : 1]);
+    glBindTextureUnit(3, snow_height_tex);
+    glBindTextureUnit(4, snow_normal_tex);
+    snow_terrain_object.get_material().bind_buffer_base(PhongMaterialUBO::DEFAULT_MATERIAL_BINDING);
+
+    // All blocks of all levels are drawn by one instanced draw, the clip distances cut the cells at the terrain edges.
+    for (int edge = 0; edge < 4; edge++) {
+        glEnable(GL_CLIP_DISTANCE0 + edge);
+    }
+    glBindVertexArray(clipmap_vao);
+    glDrawElementsInstanced(GL_TRIANGLES, clipmap_index_count, GL_UNSIGNED_INT, nullptr, clipmap_block_count);
+    frame_draw_calls++;
+    for (int edge = 0; edge < 4; edge++) {
+        glDisable(GL_CLIP_DISTANCE0 + edge);
+    }
+}
+
+void Application::update_clipmap_blocks(glm::vec2 center) {
+    if (center == clipmap_blocks_center) return;
+    clipmap_blocks_center = center;
+
+    // Leaves out the blocks lying completely beyond the terrain, they would only be clipped.
+    std::vector<glm::ivec4> blocks;
+    for (const glm::ivec4& block : clipmap_blocks) {
+        float cell_size = CLIPMAP_CELL_SIZE * static_cast<float>(1 << block.z);
+        glm::vec2 first = center + glm::vec2(block.x, block.y) * cell_size;
+        glm::vec2 last = first + static_cast<float>(CLIPMAP_BLOCK_SIZE) * cell_size;
+        if (last.x > -13.0f && last.y > -13.0f && first.x < 13.0f && first.y < 13.0f) {
+            blocks.push_back(block);
+        }
+    }
+    clipmap_block_count = static_cast<GLsizei>(blocks.size());
+    if (!blocks.empty()) {
+        glNamedBufferSubData(clipmap_blocks_bo, 0, blocks.size() * sizeof(glm::ivec4), blocks.data());
+        frame_upload_bytes += blocks.size() * sizeof(glm::ivec4);
+    }
 }
 
 void Application::render_object(const SceneObject& object, const ShaderProgram& program, bool render_as_patches,
@@ -446,44 +908,144 @@ void Application::clear_accumulated_snow() {
     glBindFramebuffer(GL_DRAW_FRAMEBUFFER, accumulated_snow_fbo[0]);
     glClearBufferfv(GL_COLOR, 0, &clear_color);
 
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, accumulated_snow_fbo[1]);
-    glClearBufferfv(GL_COLOR, 0, &clear_color);
+    if (accumulated_snow_tex[1] != 0) {
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, accumulated_snow_fbo[1]);
+        glClearBufferfv(GL_COLOR, 0, &clear_color);
+    }
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glClearTexImage(snow_deposits_tex, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+    snow_level = 0.0f;
+    std::fill(snow_tile_dirty_steps.begin(), snow_tile_dirty_steps.end(), uint8_t(0));
+}
+
+void Application::switch_snow_accumulation() {
+    if (compute_snow) {
+        // The compute path continues with the blurred snow of the fragment passes and releases their second texture.
+        glCopyImageSubData(accumulated_snow_tex[1], GL_TEXTURE_2D, 0, 0, 0, 0, accumulated_snow_tex[0], GL_TEXTURE_2D, 0, 0, 0, 0,
+                           snow_map_size, snow_map_size, 1);
+        glNamedFramebufferTexture(accumulated_snow_fbo[1], GL_COLOR_ATTACHMENT0, 0, 0);
+        glDeleteTextures(1, &accumulated_snow_tex[1]);
+        accumulated_snow_tex[1] = 0;
+
+        // The fragment passes blurred the whole map, every tile is blurred until the change mask finds it settled.
+        std::fill(snow_tile_dirty_steps.begin(), snow_tile_dirty_steps.end(), SNOW_TILE_DIRTY_STEPS);
+    } else {
+        // The fragment passes read the blurred snow from the second texture, the snow level stays where it is.
+        create_snow_texture(1);
+        glCopyImageSubData(accumulated_snow_tex[0], GL_TEXTURE_2D, 0, 0, 0, 0, accumulated_snow_tex[1], GL_TEXTURE_2D, 0, 0, 0, 0,
+                           snow_map_size, snow_map_size, 1);
+    }
 }
 
 void Application::accumulate_snow() {
     int accumulation_speed_exp = static_cast<int>(log2(current_snow_count) - 7);
     double acc_speed = 100.0 / accumulation_speed_exp;
+    snow_timer.collect();
     if (last_frame + acc_speed > elapsed_time) return;
     last_frame += acc_speed;
 
+    snow_timer.begin(benchmark_recorder.frame_count());
+    if (compute_snow) {
+        // The snowfall only raises the snow level, the texture changes just in the dirty tiles.
+        snow_level += 0.0005f;
+
+        // Keeps the tiles whose blur still changed the snow a few steps ago (or whose neighbour's did) dirty.
+        if (snow_changed_tiles_readback.collect(snow_changed_tiles)) {
+            for (size_t tile = 0; tile < snow_tile_dirty_steps.size(); tile++) {
+                if (snow_changed_tiles[tile / 32] & (1u << (tile % 32))) {
+                    snow_tile_dirty_steps[tile] = SNOW_TILE_DIRTY_STEPS;
+                }
+            }
+            std::fill(snow_changed_tiles.begin(), snow_changed_tiles.end(), 0u);
+        }
+
+        // Collects the dirty tiles in four groups by the parity of their coordinates. The tiles within one group
+        // are never neighbours, so each group can be blurred in place by one dispatch.
+        snow_dirty_tiles.clear();
+        size_t group_start[5] = {0, 0, 0, 0, 0};
+        for (int group = 0; group < 4; group++) {
+            group_start[group] = snow_dirty_tiles.size();
+            for (int y = group / 2; y < snow_tiles_per_side; y += 2) {
+                for (int x = group % 2; x < snow_tiles_per_side; x += 2) {
+                    uint8_t& steps = snow_tile_dirty_steps[y * snow_tiles_per_side + x];
+                    if (steps > 0) {
+                        steps--;
+                        snow_dirty_tiles.push_back(static_cast<uint32_t>(x) | (static_cast<uint32_t>(y) << 16));
+                    }
+                }
+            }
+        }
+        group_start[4] = snow_dirty_tiles.size();
+
+        if (!snow_dirty_tiles.empty()) {
+            glNamedBufferSubData(snow_dirty_tiles_bo, 0, snow_dirty_tiles.size() * sizeof(uint32_t), snow_dirty_tiles.data());
+            frame_upload_bytes += snow_dirty_tiles.size() * sizeof(uint32_t);
+
+            accumulate_snow_compute_program.use();
+            accumulate_snow_compute_program.uniform("tiles_per_side", snow_tiles_per_side);
+            glBindImageTexture(0, accumulated_snow_tex[0], 0, GL_FALSE, 0, GL_READ_WRITE, GL_R16F);
+            glBindImageTexture(1, snow_deposits_tex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, snow_dirty_tiles_bo);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, snow_changed_tiles_bo);
+            for (int group = 0; group < 4; group++) {
+                GLuint count = static_cast<GLuint>(group_start[group + 1] - group_start[group]);
+                if (count == 0) continue;
+                accumulate_snow_compute_program.uniform("first_tile", static_cast<int>(group_start[group]));
+                glDispatchCompute(count, 1, 1);
+                glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+                frame_draw_calls++;
+            }
+
+            // The snow is then sampled and the broom renders into it, the change mask is copied for the readback.
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+            glUseProgram(0);
+        }
+
+        // The mask is read even without dirty tiles, the snowflakes mark the tiles they deposited into.
+        snow_changed_tiles_readback.request(snow_changed_tiles_bo);
+        snow_timer.end();
+        return;
+    }
+
     accumulate_snow_program.use();
-    glViewport(0, 0, 1024, 1024);
+    glViewport(0, 0, snow_map_size, snow_map_size);
     glBindVertexArray(empty_vao);
 
     glBindFramebuffer(GL_FRAMEBUFFER, accumulated_snow_fbo[0]);
     glBindTextureUnit(0, accumulated_snow_tex[1]);
+    glBindTextureUnit(1, snow_deposits_tex);
     glDrawArrays(GL_TRIANGLES, 0, 3);
+    frame_draw_calls++;
 
     glBindFramebuffer(GL_FRAMEBUFFER, accumulated_snow_fbo[1]);
     glBindTextureUnit(0, accumulated_snow_tex[0]);
     glDrawArrays(GL_TRIANGLES, 0, 3);
+    frame_draw_calls++;
 
     glBindVertexArray(0);
     glUseProgram(0);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
+    // The deposits are in the snow now, the snowflakes start the next ones from zero.
+    glClearTexImage(snow_deposits_tex, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
     apply_blur();
+    snow_timer.end();
 }
 
 void Application::use_broom() {
     ortho_camera_ubo.bind_buffer_base(CameraUBO::DEFAULT_CAMERA_BINDING);
-    glBindFramebuffer(GL_FRAMEBUFFER, accumulated_snow_fbo[1]);
-    glViewport(0, 0, 1024, 1024);
+    glBindFramebuffer(GL_FRAMEBUFFER, accumulated_snow_fbo[compute_snow ? 0 : 1]);
+    glViewport(0, 0, snow_map_size, snow_map_size);
     glDisable(GL_DEPTH_TEST);
 
+    broom_program.use();
+    broom_program.uniform("snow_level", snow_level);
     render_object(broom_object, broom_program, false);
+    frame_draw_calls++;
+    mark_broom_tiles();
 
     glBindVertexArray(0);
     glUseProgram(0);
@@ -492,9 +1054,32 @@ void Application::use_broom() {
     camera_ubo.bind_buffer_base(CameraUBO::DEFAULT_CAMERA_BINDING);
 }
 
+void Application::mark_broom_tiles() {
+    if (!compute_snow) return;
+
+    // Projects the broom and its radius into the snow map.
+    glm::vec3 position = broom_readback.last_position;
+    glm::vec4 center = snow_matrix * glm::vec4(position, 1.0f);
+    glm::vec4 side_x = snow_matrix * glm::vec4(position + glm::vec3(broom_radius, 0.0f, 0.0f), 1.0f);
+    glm::vec4 side_z = snow_matrix * glm::vec4(position + glm::vec3(0.0f, 0.0f, broom_radius), 1.0f);
+    glm::vec2 center_uv = glm::vec2(center) / center.w;
+    float radius_uv = std::max(glm::length(glm::vec2(side_x) / side_x.w - center_uv), glm::length(glm::vec2(side_z) / side_z.w - center_uv));
+
+    // Marks the tiles under the broom and one more tile around them, the blur spreads the stamp to the neighbours.
+    glm::ivec2 first = glm::ivec2(glm::floor((center_uv - radius_uv) * float(snow_map_size) / float(SNOW_TILE_SIZE))) - 1;
+    glm::ivec2 last = glm::ivec2(glm::floor((center_uv + radius_uv) * float(snow_map_size) / float(SNOW_TILE_SIZE))) + 1;
+    first = glm::max(first, glm::ivec2(0));
+    last = glm::min(last, glm::ivec2(snow_tiles_per_side - 1));
+    for (int y = first.y; y <= last.y; y++) {
+        for (int x = first.x; x <= last.x; x++) {
+            snow_tile_dirty_steps[y * snow_tiles_per_side + x] = SNOW_TILE_DIRTY_STEPS;
+        }
+    }
+}
+
 void Application::apply_blur() {
     blur_program.use();
-    glViewport(0, 0, 1024, 1024);
+    glViewport(0, 0, snow_map_size, snow_map_size);
     glClear(GL_COLOR_BUFFER_BIT);
     glDisable(GL_DEPTH_TEST);
 
@@ -504,6 +1089,7 @@ void Application::apply_blur() {
     glBindTextureUnit(0, accumulated_snow_tex[0]);
     
     glDrawArrays(GL_TRIANGLES, 0, 3);
+    frame_draw_calls++;
 
     glBindVertexArray(0);
     glUseProgram(0);
@@ -517,7 +1103,7 @@ void Application::render_ui() {
     const float unit = ImGui::GetFontSize();
 
     ImGui::Begin("Settings", nullptr, ImGuiWindowFlags_NoDecoration);
-    ImGui::SetWindowSize(ImVec2(20 * unit, 17 * unit));
+    ImGui::SetWindowSize(ImVec2(20 * unit, 24 * unit));
     ImGui::SetWindowPos(ImVec2(2 * unit, 2 * unit));
 
     ImGui::PushItemWidth(150.f);
@@ -538,12 +1124,31 @@ void Application::render_ui() {
 
     ImGui::Checkbox("Show Snow", &show_snow);
 
+    ImGui::SliderFloat("Wind", &wind_strength, 0.0f, 5.0f);
+
     ImGui::Checkbox("Show Tessellated Snow", &show_tessellated_snow);
 
+    ImGui::Checkbox("Adaptive Tessellation", &adaptive_tessellation);
+
+    ImGui::Checkbox("Clipmap Snow", &clipmap_snow);
+
     ImGui::Checkbox("Wireframe", &wireframe);
 
     ImGui::Checkbox("Use PBR", &pbr);
 
+    // Both paths store the snow relative to the snow level, so switching them keeps the snow.
+    if (ImGui::Checkbox("Compute Snow Accumulation", &compute_snow)) {
+        switch_snow_accumulation();
+    }
+
+    const char* snow_map_labels[5] = {"512", "1024", "2048", "4096", "8192"};
+    int snow_map_index = static_cast<int>(log2(snow_map_size / MIN_SNOW_MAP_SIZE));
+    if (ImGui::Combo("Snow Map Size", &snow_map_index, snow_map_labels, IM_ARRAYSIZE(snow_map_labels))) {
+        snow_map_size = MIN_SNOW_MAP_SIZE << snow_map_index;
+        initialize_fbo_textures();
+        clear_accumulated_snow();
+    }
+
     const char* particle_labels[10] = {"256", "512", "1024", "2048", "4096", "8192", "16384", "32768", "65536", "131072"};
     int exponent = static_cast<int>(log2(current_snow_count) - 8); // -8 because we start at 256 = 2^8
     if (ImGui::Combo("Particle Count", &exponent, particle_labels, IM_ARRAYSIZE(particle_labels))) {
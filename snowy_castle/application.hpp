@@ -6,10 +6,79 @@
 // ################################################################################
 
 #pragma once
+#include "../common/benchmark.hpp"
 #include "camera_ubo.hpp"
 #include "light_ubo.hpp"
 #include "pv227_application.hpp"
 #include "scene_object.hpp"
+#include <limits>
+
+/**
+ * Reads single depth values of the bound read frame buffer back through a ring of pixel buffers. Each read is fenced
+ * and consumed once the GPU finished it, usually one or two frames later, so the CPU never waits for the GPU.
+ */
+class DepthReadback {
+  public:
+    /** The number of reads that can be in flight, further reads replace the oldest one. */
+    static const int FRAMES = 3;
+
+    void create();
+    void destroy();
+
+    /**
+     * Copies the depth at the given pixel into the next pixel buffer. The viewport size and the clip-to-world
+     * matrix of the current frame are kept to unproject the depth once it arrives. Pixels outside the viewport
+     * are ignored.
+     */
+    void request(glm::vec2 pixel, glm::vec2 viewport_size, const glm::mat4& clip_to_world);
+
+    /** Reads the finished requests, returns true when last_position was updated. */
+    bool collect();
+
+    /** The world space position of the most recent finished read. */
+    glm::vec3 last_position = glm::vec3(0.0f);
+
+  private:
+    GLuint buffers[FRAMES] = {};
+    GLsync fences[FRAMES] = {};
+    /** The normalized device coordinates of the read pixels. */
+    glm::vec2 ndc_positions[FRAMES];
+    glm::mat4 clip_to_world[FRAMES];
+    /** The number of issued reads. */
+    uint64_t issued = 0;
+    /** The number of consumed (or replaced) reads. */
+    uint64_t read = 0;
+};
+
+/**
+ * Reads the bit mask of the snow tiles changed on the GPU back through a ring of buffers, fenced like DepthReadback.
+ * While all buffers are in flight the mask is left on the GPU, so its bits are read with the next request instead.
+ */
+class TileMaskReadback {
+  public:
+    /** The number of reads that can be in flight. */
+    static const int FRAMES = 3;
+
+    /** Creates the buffers for a mask of the given number of 32-bit words. */
+    void create(int words);
+    void destroy();
+
+    /** Copies the mask into the next buffer and clears it, nothing is copied while all buffers are in flight. */
+    void request(GLuint mask_buffer);
+
+    /** Ors the finished reads into the mask, returns true when any read finished. */
+    bool collect(std::vector<uint32_t>& mask);
+
+  private:
+    GLuint buffers[FRAMES] = {};
+    GLsync fences[FRAMES] = {};
+    /** The number of 32-bit words of the mask. */
+    int words = 0;
+    /** The number of issued reads. */
+    uint64_t issued = 0;
+    /** The number of consumed reads. */
+    uint64_t read = 0;
+};
 
 class Application : public PV227Application {
     // ----------------------------------------------------------------------------
@@ -29,15 +98,39 @@ class Application : public PV227Application {
 
     /** The broom position. */
     glm::vec2 broom_center;
+    /** The asynchronous read of the scene depth under the broom. */
+    DepthReadback broom_readback;
 
     /** The scene object storing information about the broom model. */
     SceneObject broom_object;
     /** The scene object representing the light. */
     SceneObject light_object;
 
-    /** The data for the particles. */
-    GLuint snow_positions_bo;
-    GLuint snow_vao;
+    /** The positions and velocities of the snowflakes, allocated once for MAX_SNOW_COUNT snowflakes. */
+    GLuint snow_positions_bo = 0;
+    GLuint snow_velocities_bo = 0;
+    GLuint snow_vao = 0;
+    /** The largest snow particle count. */
+    static constexpr int MAX_SNOW_COUNT = 131072;
+
+    /** The grid of one clipmap block, its indices, the blocks on the terrain and the VAO with the blocks as instances. */
+    GLuint clipmap_vertices_bo = 0;
+    GLuint clipmap_indices_bo = 0;
+    GLuint clipmap_blocks_bo = 0;
+    GLuint clipmap_vao = 0;
+    /** The number of indices of one block and the number of blocks in clipmap_blocks_bo. */
+    GLsizei clipmap_index_count = 0;
+    GLsizei clipmap_block_count = 0;
+    /** The blocks of all levels relative to the clipmap center, those overlapping the terrain are uploaded. */
+    std::vector<glm::ivec4> clipmap_blocks;
+    /** The clipmap center the blocks in clipmap_blocks_bo were selected for. */
+    glm::vec2 clipmap_blocks_center = glm::vec2(std::numeric_limits<float>::infinity());
+    /** The number of cells along one side of a block, each level consists of 4x4 blocks without the 2x2 in the center. */
+    static constexpr int CLIPMAP_BLOCK_SIZE = 16;
+    /** The number of nested levels, the coarsest one covers the whole terrain from any point of it. */
+    static constexpr int CLIPMAP_LEVELS = 6;
+    /** The size of one cell of the finest level in world space. */
+    static constexpr float CLIPMAP_CELL_SIZE = 26.0f / 1024.0f;
 
     // ----------------------------------------------------------------------------
     // Variables (Materials)
@@ -69,8 +162,20 @@ class Application : public PV227Application {
     /** The snow roughness. */
     GLuint snow_roughness_tex;
 
-    /** The accumulated snow textures: snow1,snow2,depth1,depth2 */
-    GLuint accumulated_snow_tex[2];
+    /**
+     * The accumulated snow textures. The compute accumulation uses only the first one, the second one is allocated
+     * just for the fragment passes bouncing between them.
+     */
+    GLuint accumulated_snow_tex[2] = {};
+    /** The buffer with the dirty tiles the compute accumulation blurs in the current step. */
+    GLuint snow_dirty_tiles_bo = 0;
+    /** The bit mask of the tiles the compute blur still changed (and their neighbours), one bit per tile. */
+    GLuint snow_changed_tiles_bo = 0;
+    /**
+     * The snow the landed snowflakes deposited since the accumulation took it, in fixed point so the snowflakes can
+     * add it atomically. One texel covers SNOW_DEPOSIT_CELL_SIZE x SNOW_DEPOSIT_CELL_SIZE texels of the snow map.
+     */
+    GLuint snow_deposits_tex = 0;
     /** The orthogonal view texture. */
     GLuint ortho_tex;
     /** The orthogonal view depth texture. */
@@ -105,8 +210,12 @@ class Application : public PV227Application {
   protected:
     /** A shader for rendering snowflakes. */
     ShaderProgram snowflakes_program;
+    /** A compute shader moving the snowflakes and adding the landed ones to the snow deposits. */
+    ShaderProgram snowflakes_update_program;
     /** A shader for rendering tesselation snow. */
     ShaderProgram snow_program;
+    /** A shader for rendering the snow as a clipmap. */
+    ShaderProgram snow_clipmap_program;
     /** A shader for rendering textures. */
     ShaderProgram display_texture_program;
     /** A shader for accumulating snow. */
@@ -115,6 +224,8 @@ class Application : public PV227Application {
     ShaderProgram broom_program;
     /** A shader bluring a texture. */
     ShaderProgram blur_program;
+    /** A compute shader blurring the dirty tiles of the accumulated snow in place. */
+    ShaderProgram accumulate_snow_compute_program;
 
     // ----------------------------------------------------------------------------
     // Variables (Frame Buffers)
@@ -152,6 +263,9 @@ class Application : public PV227Application {
     /** The flag determining if a snow should be visible. */
     bool show_snow = true;
 
+    /** The strength of the wind blowing the snowflakes. */
+    float wind_strength = 1.0f;
+
     /** The flag determining polygon fill mode. */
     bool wireframe = false;
 
@@ -161,6 +275,86 @@ class Application : public PV227Application {
     /** The flag determining if tessellated snow will be visible. */
     bool show_tessellated_snow = true;
 
+    /**
+     * The flag determining if the tessellation levels adapt to the size of the patch edges on the screen and patches
+     * without snow are culled. Otherwise every patch is tessellated with the fixed level 128 (--fixed-tessellation).
+     */
+    bool adaptive_tessellation = true;
+
+    /** The flag determining if the snow surface is rendered as a clipmap instead of tessellated (--clipmap-snow). */
+    bool clipmap_snow = false;
+
+    /**
+     * The flag determining if the snow is accumulated by the compute shader in place in accumulated_snow_tex[0].
+     * Otherwise the fragment shader passes bounce between both textures and the blurred snow is in accumulated_snow_tex[1].
+     * Both paths store the snow relative to snow_level, the fragment passes only do not raise it.
+     */
+    bool compute_snow = true;
+
+    /** The width and height of the accumulated snow textures, set by --snow-map-size=<texels>. */
+    int snow_map_size = 1024;
+    /** The smallest and largest snow map size. */
+    static constexpr int MIN_SNOW_MAP_SIZE = 512;
+    static constexpr int MAX_SNOW_MAP_SIZE = 8192;
+
+    // ----------------------------------------------------------------------------
+    // Variables (Snow Tiles)
+    // ----------------------------------------------------------------------------
+  protected:
+    /** The size of one tile of the snow map in texels, must match TILE_SIZE in accumulate_snow.comp. */
+    static constexpr int SNOW_TILE_SIZE = 64;
+    /** The number of snow map texels along one side of a deposit texel, must match DEPOSIT_CELL_SIZE in the shaders. */
+    static constexpr int SNOW_DEPOSIT_CELL_SIZE = 4;
+    /**
+     * The number of accumulation steps a tile stays dirty after it was marked, by the broom or by the change mask.
+     * It covers the latency of the change mask readback, a tile whose blur still changes the snow is marked again
+     * before it runs out.
+     */
+    static constexpr uint8_t SNOW_TILE_DIRTY_STEPS = TileMaskReadback::FRAMES + 1;
+    /**
+     * The snow level the compute accumulation adds to the whole map. The texture stores the snow relative to it,
+     * so the snowfall does not touch any texel and only the tiles the broom disturbed have to be blurred.
+     */
+    float snow_level = 0.0f;
+    /** The number of tiles along one side of the snow map. */
+    int snow_tiles_per_side = 0;
+    /** The dirty tile map - the remaining accumulation steps of each tile, 0 for a clean tile. */
+    std::vector<uint8_t> snow_tile_dirty_steps;
+    /** The asynchronous read of snow_changed_tiles_bo and the changed tiles it delivered. */
+    TileMaskReadback snow_changed_tiles_readback;
+    std::vector<uint32_t> snow_changed_tiles;
+    /** The dirty tiles of the current step ordered by the parity of their coordinates. */
+    std::vector<uint32_t> snow_dirty_tiles;
+    /** The radius of the broom in world space. */
+    float broom_radius = 0.0f;
+
+    // ----------------------------------------------------------------------------
+    // Variables (Benchmark)
+    // ----------------------------------------------------------------------------
+  protected:
+    /** The number of frames of the --benchmark=<frames> run, 0 when running interactively. */
+    int benchmark_frames = 0;
+    /** The report path without extension, set by --benchmark-report=<path>. */
+    std::filesystem::path benchmark_report = "snowy_castle_benchmark";
+    /** The GPU time of render(), also shown as fps_gpu. */
+    GpuTimer gpu_timer;
+    /** The GPU time of one snow accumulation step. */
+    GpuTimer snow_timer;
+    /** The sum of the measured snow accumulation times [ms] and their count, reported after the benchmark. */
+    double snow_time_sum = 0.0;
+    int snow_time_count = 0;
+    /** The GPU time of rendering the tessellated or clipmap snow. */
+    GpuTimer tessellation_timer;
+    /** The sum of the measured snow surface times [ms] and their count, reported after the benchmark. */
+    double tessellation_time_sum = 0.0;
+    int tessellation_time_count = 0;
+    /** The measurements of the finished benchmark frames. */
+    BenchmarkRecorder benchmark_recorder;
+    /** The draw calls issued in the current frame. */
+    uint32_t frame_draw_calls = 0;
+    /** The bytes written into buffers in the current frame (framework UBO updates are not included). */
+    uint64_t frame_upload_bytes = 0;
+
     // ----------------------------------------------------------------------------
     // Constructors
     // ----------------------------------------------------------------------------
@@ -191,15 +385,24 @@ class Application : public PV227Application {
     /** Prepares the required textures. */
     void prepare_textures();
 
+    /** Loads the image as a block-compressed texture, a .dds cache of it is kept next to it to skip the compression on later starts. */
+    GLuint load_texture(const std::filesystem::path& filename, GLenum format);
+
     /** Prepares the lights. */
     void prepare_lights();
 
     /** Prepares the scene objects. */
     void prepare_scene();
 
-    /** Prepares the snow.*/
+    /** Loads the .obj file, a binary cache of it is kept in the cache directory to skip parsing on later starts. */
+    Geometry load_geometry(const std::filesystem::path& filename);
+
+    /** Prepares the snowflakes, the buffers are sized for MAX_SNOW_COUNT so changing the count does not recreate them. */
     void prepare_snow();
 
+    /** Prepares the static meshes of the clipmap snow. */
+    void prepare_clipmap();
+
     /** Prepares the frame buffer objects. */
     void prepare_framebuffers();
 
@@ -209,6 +412,9 @@ class Application : public PV227Application {
     /** Initializes textures for snow accumulation. */
     void initialize_fbo_textures();
 
+    /** Creates the accumulated snow texture with the given index and attaches it to its frame buffer. */
+    void create_snow_texture(int index);
+
     /** Applies blur. */
     void apply_blur();
 
@@ -222,10 +428,17 @@ class Application : public PV227Application {
 
     /**
      * Updates the broom location. Note that this method expects that the currently bind depth buffer contains
-     * information about the whole scene (except the broom itself).
+     * information about the whole scene (except the broom itself). The depth is read asynchronously, so the broom
+     * follows the depth from one or two frames ago.
      */
     void update_broom_location();
 
+    /**
+     * Moves the snowflakes by the given time step [ms]. The snowflakes that land on the scene seen from above
+     * deposit into the accumulated snow and are spawned again.
+     */
+    void update_snowflakes(float delta);
+
     // ----------------------------------------------------------------------------
     // Render
     // ----------------------------------------------------------------------------
@@ -236,6 +449,9 @@ class Application : public PV227Application {
     /** Renders the whole scene. */
     void render_scene(const ShaderProgram& program, bool render_broom);
 
+    /** Records the frame of the benchmark run, writes the report and closes the window after the last frame. */
+    void finish_benchmark_frame(double cpu_ms);
+
     /** Renders final scene */
     void render_final();
 
@@ -251,6 +467,12 @@ class Application : public PV227Application {
     /** Clears the accumulated snow. */
     void clear_accumulated_snow();
 
+    /**
+     * Moves the accumulated snow between the textures of the compute and the fragment accumulation after compute_snow
+     * changed, and allocates or releases the second texture the fragment passes need.
+     */
+    void switch_snow_accumulation();
+
     /** Accumulates snow in textures. */
     void accumulate_snow();
 
@@ -260,9 +482,18 @@ class Application : public PV227Application {
     /** Renders tesselated snow. */
     void render_tese_snow();
 
+    /** Renders the snow as nested rings of grid blocks centered below the camera, displaced in the vertex shader. */
+    void render_clipmap_snow();
+
+    /** Uploads the clipmap blocks overlapping the terrain around the given center, when the center moved. */
+    void update_clipmap_blocks(glm::vec2 center);
+
     /** Renders broom as black to accumulated snow texture. */
     void use_broom();
 
+    /** Marks the tiles of the snow map under the broom (and their neighbours) dirty. */
+    void mark_broom_tiles();
+
     // ----------------------------------------------------------------------------
     // GUI
     // ----------------------------------------------------------------------------
@@ -14,6 +14,13 @@ in VertexData
 
 // The texture to be blurred.
 layout (binding = 0) uniform sampler2D accumulated_snow_old;
+// The snow deposited by the snowflakes, one texel per DEPOSIT_CELL_SIZE x DEPOSIT_CELL_SIZE snow texels.
+layout (binding = 1) uniform usampler2D snow_deposits;
+
+// The number of snow map texels along one side of a deposit texel and the fixed point scale of the deposits,
+// must match accumulate_snow.comp.
+#define DEPOSIT_CELL_SIZE 4
+#define DEPOSIT_SCALE 65536.0
 
 
 // ----------------------------------------------------------------------------
@@ -31,7 +38,9 @@ void main()
 	vec2 texel_size = 1.0 / textureSize(accumulated_snow_old, 0);		
 	float original = texture(accumulated_snow_old, in_data.tex_coord).r;
 
-	accumulated_snow_new = original + 0.0005;
+	float deposit = float(texelFetch(snow_deposits, ivec2(gl_FragCoord.xy) / DEPOSIT_CELL_SIZE, 0).r) / DEPOSIT_SCALE;
+
+	accumulated_snow_new = original + 0.0005 + deposit;
 	
 	// We use Gaussian blur.
 	//vec3 sum = vec3(0.f);
@@ -24,6 +24,8 @@ layout (std140, binding = 3) uniform PhongMaterialBuffer
 uniform bool has_texture;
 // The texture that will be used (if available).
 layout(binding = 0) uniform sampler2D material_diffuse_texture;
+// The snow level the accumulated snow is relative to.
+uniform float snow_level = 0.0;
 
 // ----------------------------------------------------------------------------
 // Output Variables
@@ -36,5 +38,5 @@ layout (location = 0) out float final_color;
 // ----------------------------------------------------------------------------
 void main()
 {
-	final_color = 0.0;
+	final_color = -snow_level;
 }
\ No newline at end of file
@@ -0,0 +1,113 @@
+#version 450 core
+
+// ----------------------------------------------------------------------------
+// Input Variables
+// ----------------------------------------------------------------------------
+layout (location = 0) in vec2 grid_position; // The vertex position in the block in cells.
+layout (location = 3) in ivec4 block;        // The block origin in cells of its level (xy) and the level (z).
+
+// The UBO with camera data.	
+layout (std140, binding = 0) uniform CameraBuffer
+{
+	mat4 projection;		// The projection matrix.
+	mat4 projection_inv;	// The inverse of the projection matrix.
+	mat4 view;				// The view matrix
+	mat4 view_inv;			// The inverse of the view matrix.
+	mat3 view_it;			// The inverse of the transpose of the top-left part 3x3 of the view matrix
+	vec3 eye_position;		// The position of the eye in world space.
+};
+
+layout (binding = 1) uniform sampler2D ortho_depth_tex;
+layout (binding = 2) uniform sampler2D accumulated_snow_tex;
+layout (binding = 3) uniform sampler2D height_tex;
+uniform mat4 snow_matrix;
+// The snow level the accumulated snow is relative to.
+uniform float snow_level = 0.0;
+
+// The center of all levels in world space, snapped to the cells of the coarsest level.
+uniform vec2 clipmap_center;
+// The size of one cell of the finest level in world space, each next level doubles it.
+uniform float clipmap_cell_size;
+// The number of levels.
+uniform int clipmap_levels;
+// The number of cells along one side of a block, each level is 4x4 blocks.
+uniform int block_size;
+// The half of the size of the snow terrain, the cells beyond it are clipped.
+uniform float terrain_half_size = 13.0;
+
+// ----------------------------------------------------------------------------
+// Output Variables
+// ----------------------------------------------------------------------------
+out VertexData
+{
+	vec3 position_ws;	  // The vertex position in world space.
+	vec3 normal_ws;		  // The vertex normal in world space.
+	vec2 tex_coord;		  // The vertex texture coordinates.
+} out_data;
+
+// The distances to the four terrain edges, negative beyond them.
+out float gl_ClipDistance[4];
+
+// ----------------------------------------------------------------------------
+// Local Functions
+// ----------------------------------------------------------------------------
+// Returns the undisplaced world position of the given cell corner of the given level.
+vec3 level_position(ivec2 cell, int level)
+{
+	float cell_size = clipmap_cell_size * float(1 << level);
+	vec2 xz = clipmap_center + vec2(cell) * cell_size;
+	return vec3(xz.x, 0.0, xz.y);
+}
+
+// Returns the texture coordinates of the snow terrain at the given position.
+vec2 terrain_tex_coord(vec3 position_ws)
+{
+	return position_ws.xz / (2.0 * terrain_half_size) + 0.5;
+}
+
+// Returns the height of the snow at the given position (the same displacement as snow.tese).
+float snow_height(vec3 position_ws)
+{
+	vec4 snow_tex_coord = snow_matrix * vec4(position_ws, 1.0);
+	float snow_factor = 0.0;
+
+	float dist_in_tex = textureProjLod(ortho_depth_tex, snow_tex_coord, 0).x;
+
+	if (!(dist_in_tex + 0.00005 < snow_tex_coord.z / snow_tex_coord.w)) {
+		snow_factor = textureProjLod(accumulated_snow_tex, snow_tex_coord, 0).r + snow_level;
+	}
+
+	return textureLod(height_tex, terrain_tex_coord(position_ws), 0).x * snow_factor * 0.6;
+}
+
+// ----------------------------------------------------------------------------
+// Main Method
+// ----------------------------------------------------------------------------
+void main()
+{
+	ivec2 cell = block.xy + ivec2(grid_position);
+	int level = block.z;
+	vec3 position_ws = level_position(cell, level);
+	float height = snow_height(position_ws);
+
+	// The odd vertices on the outer edge of a level lie in the middle of an edge of the next coarser level, they take
+	// the height of that edge so the levels do not crack.
+	int ring = 2 * block_size;
+	if (level < clipmap_levels - 1) {
+		if (abs(cell.x) == ring && (cell.y & 1) != 0) {
+			height = 0.5 * (snow_height(level_position(cell + ivec2(0, 1), level)) + snow_height(level_position(cell - ivec2(0, 1), level)));
+		} else if (abs(cell.y) == ring && (cell.x & 1) != 0) {
+			height = 0.5 * (snow_height(level_position(cell + ivec2(1, 0), level)) + snow_height(level_position(cell - ivec2(1, 0), level)));
+		}
+	}
+
+	out_data.tex_coord = terrain_tex_coord(position_ws);
+	out_data.normal_ws = vec3(0.0, 1.0, 0.0);
+	out_data.position_ws = position_ws + vec3(0.0, height, 0.0);
+
+	gl_Position = projection * view * vec4(out_data.position_ws, 1.0);
+	gl_ClipDistance[0] = terrain_half_size + position_ws.x;
+	gl_ClipDistance[1] = terrain_half_size - position_ws.x;
+	gl_ClipDistance[2] = terrain_half_size + position_ws.z;
+	gl_ClipDistance[3] = terrain_half_size - position_ws.z;
+}
@@ -70,6 +70,8 @@ layout (binding = 2) uniform sampler2D accumulated_snow_tex;
 // The premultiplied shadow matrix.
 uniform mat4 snow_matrix;
 uniform bool use_snow = false;
+// The snow level the accumulated snow is relative to.
+uniform float snow_level = 0.0;
 
 // ----------------------------------------------------------------------------
 // Output Variables
@@ -89,7 +91,7 @@ void main()
 	
 		if (!(dist_in_tex + 0.000005 < snow_tex_coord.z / snow_tex_coord.w)) {
 			snow_factor = dot(in_data.normal_ws, vec3(0.0, 1.0, 0.0)); // computes snow factor
-			snow_factor *= textureProj(accumulated_snow_tex, snow_tex_coord).r;
+			snow_factor *= (textureProj(accumulated_snow_tex, snow_tex_coord).r + snow_level);
 			snow_factor = clamp(snow_factor, 0.0, 1.0);
 		}
 	}
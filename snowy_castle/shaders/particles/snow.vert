@@ -3,10 +3,7 @@
 // ----------------------------------------------------------------------------
 // Input Variables
 // ----------------------------------------------------------------------------
-layout (location = 0) in vec4 position;
-
-// The elapsed time in seconds.
-uniform float elapsed_time_s;
+layout (location = 0) in vec4 position; // The position of the snowflake moved by snow.comp.
 
 // ----------------------------------------------------------------------------
 // Output Variables
@@ -33,7 +30,6 @@ layout (std140, binding = 0) uniform CameraBuffer
 // ----------------------------------------------------------------------------
 void main()
 {
-	vec4 p = position;
-	p.y = mod(p.y - elapsed_time_s * 3.0, 50.0);
-	out_data.position_vs = view * p;
+	out_data.position_ws = position.xyz;
+	out_data.position_vs = view * vec4(position.xyz, 1.0);
 }
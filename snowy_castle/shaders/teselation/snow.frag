@@ -79,7 +79,9 @@ void main()
 {
 	// Computes the lighting.
 	vec4 snow_tex_coord = snow_matrix * vec4(in_data.position_ws, 1.0);
-	vec3 normal_from_texture = textureProj(normal_tex, snow_tex_coord).rgb * 2.0 - 1.0;
+	// The normal map is stored as BC5 with x and y only.
+	vec2 normal_xy = textureProj(normal_tex, snow_tex_coord).rg * 2.0 - 1.0;
+	vec3 normal_from_texture = vec3(normal_xy, sqrt(max(1.0 - dot(normal_xy, normal_xy), 0.0)));
 
 	// Apply normal mapping.
 	float e = 1.0 / textureSize(accumulated_snow_tex, 0).x;